@@ -68,42 +68,18 @@ static inline void dfps_set_info (PixmapPtr pixmap, dfps_info_t *info)
 {
     dixSetPrivate(&pixmap->devPrivates, &uxa_pixmap_index, info);
 }
-typedef struct FrameTimer {
-    OsTimerPtr xorg_timer;
-    FrameTimerFunc func;
-    void *opaque; // also stored in xorg_timer, but needed for timer_start
-} Timer;
-
-static CARD32 xorg_timer_callback(
-    OsTimerPtr xorg_timer,
-    CARD32 time,
-    pointer arg)
-{
-    FrameTimer *timer = (FrameTimer*)arg;
-
-    timer->func(timer->opaque);
-    return 0; // if non zero xorg does a TimerSet, we don't want that.
-}
-
-static FrameTimer* timer_add(FrameTimerFunc func, void *opaque)
-{
-    FrameTimer *timer = calloc(sizeof(FrameTimer), 1);
 
-    timer->xorg_timer = TimerSet(NULL, 0, 1e9 /* TODO: infinity? */, xorg_timer_callback, timer);
-    timer->func = func;
-    timer->opaque = opaque;
-    return timer;
-}
-
-static void timer_start(FrameTimer *timer, uint32_t ms)
+void dfps_start_ticker(qxl_screen_t *qxl)
 {
-    TimerSet(timer->xorg_timer, 0 /* flags */, ms, xorg_timer_callback, timer);
+    qxl->frames_timer = qxl_timer_add(dfps_ticker, qxl);
+    qxl_timer_start(qxl->frames_timer, 1000 / qxl->deferred_fps);
 }
 
-void dfps_start_ticker(qxl_screen_t *qxl)
+void dfps_stop_ticker(qxl_screen_t *qxl)
 {
-    qxl->frames_timer = timer_add(dfps_ticker, qxl);
-    timer_start(qxl->frames_timer, 1000 / qxl->deferred_fps);
+    if (qxl->frames_timer)
+        qxl_timer_remove(qxl->frames_timer);
+    qxl->frames_timer = NULL;
 }
 
 static void dfps_ticker(void *opaque)
@@ -121,7 +97,7 @@ static void dfps_ticker(void *opaque)
         RegionUninit(&info->updated_region);
         RegionInit(&info->updated_region, NULL, 0);
     }
-    timer_start(qxl->frames_timer, 1000 / qxl->deferred_fps);
+    qxl_timer_start(qxl->frames_timer, 1000 / qxl->deferred_fps);
 }
 
 
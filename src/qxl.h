@@ -58,6 +58,7 @@
 #endif /* XSPICE */
 
 #include "qxl_drmmode.h"
+#include "qxl_timer.h"
 
 #if (XORG_VERSION_CURRENT < XORG_VERSION_NUMERIC(1, 11, 99, 903, 0))
 typedef struct list xorg_list_t;
@@ -112,6 +113,7 @@ typedef struct
 } qxl_memslot_t;
 
 typedef struct qxl_surface_t qxl_surface_t;
+typedef struct qxl_shadow_t qxl_shadow_t;
 
 /*
  * Config Options
@@ -124,6 +126,8 @@ enum {
     OPTION_DEBUG_RENDER_FALLBACKS,
     OPTION_NUM_HEADS,
     OPTION_SPICE_DEFERRED_FPS,
+    OPTION_CURSOR_MOVE_RATE,
+    OPTION_CURSOR_MOVE_FOLLOWS_FPS,
 #ifdef XSPICE
     OPTION_SPICE_PORT,
     OPTION_SPICE_TLS_PORT,
@@ -149,6 +153,9 @@ enum {
     OPTION_SPICE_DH_FILE,
     OPTION_SPICE_EXIT_ON_DISCONNECT,
     OPTION_SPICE_PLAYBACK_FIFO_DIR,
+    OPTION_SPICE_PLAYBACK_PERIOD,
+    OPTION_SPICE_PLAYBACK_LATENCY,
+    OPTION_SPICE_PLAYBACK_RATE,
     OPTION_SPICE_VDAGENT_ENABLED,
     OPTION_SPICE_VDAGENT_VIRTIO_PATH,
     OPTION_SPICE_VDAGENT_UINPUT_PATH,
@@ -157,6 +164,7 @@ enum {
     OPTION_FRAME_BUFFER_SIZE,
     OPTION_SURFACE_BUFFER_SIZE,
     OPTION_COMMAND_BUFFER_SIZE,
+    OPTION_NUM_SURFACES,
     OPTION_SPICE_SMARTCARD_FILE,
     OPTION_SPICE_VIDEO_CODECS,
 #endif
@@ -206,8 +214,9 @@ void qxl_kms_setup_funcs(qxl_screen_t *qxl);
 struct qxl_bo *qxl_ums_surf_mem_alloc(qxl_screen_t *qxl, uint32_t size);
 struct qxl_bo *qxl_ums_lookup_phy_addr(qxl_screen_t *qxl, uint64_t phy_addr);
 
-typedef struct FrameTimer FrameTimer;
-typedef void (*FrameTimerFunc)(void *opaque);
+
+#define N_CACHED_CURSORS 16
+#define N_PLACEMENT_CLASSES 8
 
 #ifdef XF86DRM_MODE
 #define MAX_RELOCS 96
@@ -295,6 +304,34 @@ struct _qxl_screen_t
     int16_t			cur_y;
     int16_t			hot_x;
     int16_t			hot_y;
+
+    /* Recently used cursor shapes, most recent first */
+    struct
+    {
+	uint64_t		unique;
+	struct qxl_bo *		bo;
+    } cursor_cache[N_CACHED_CURSORS];
+    int				n_cached_cursors;
+    unsigned int		cursor_cache_hits;
+    unsigned int		cursor_cache_misses;
+
+    int				cursor_move_rate;	/* per second, 0 = no limit */
+    OsTimerPtr			cursor_move_timer;
+    Bool			cursor_move_timer_armed;
+    Bool			cursor_move_pending;
+    Bool			cursor_moved;		/* set from signal or input thread */
+
+    /* How pixmaps of each size class have been used; see qxl_uxa.c */
+    struct
+    {
+	unsigned int		accelerated;
+	unsigned int		fallbacks;
+	unsigned int		probe;
+    } placement[N_PLACEMENT_CLASSES];
+    unsigned int		placed_on_device;
+    unsigned int		placed_on_host;
+    unsigned int		moved_to_device;
+    unsigned int		moved_to_host;
     
     ScrnInfoPtr			pScrn;
 
@@ -320,7 +357,7 @@ struct _qxl_screen_t
     int				enable_surfaces;
     int                         debug_render_fallbacks;
     
-    FrameTimer *        frames_timer;
+    qxl_timer_t *       frames_timer;
 
 #ifdef XSPICE
     /* XSpice specific */
@@ -339,6 +376,9 @@ struct _qxl_screen_t
     uint32_t           oom_running;
     uint32_t           num_free_res; /* is having a release ring effective
                                         for Xspice? */
+    uint32_t           free_bunch;   /* releases to gather per ring slot */
+    int                release_waiting; /* X thread is blocked in qxl_allocnf;
+                                           __atomic access only */
     /* This is only touched from red worker thread - do not access
      * from Xorg threads. */
     struct guest_primary {
@@ -351,12 +391,41 @@ struct _qxl_screen_t
         uint8_t        *data, *flipped;
     } guest_primary;
 
+    uint32_t           n_surfaces;
+
     char playback_fifo_dir[PATH_MAX];
     void *playback_opaque;
+    int playback_period;        /* ms per playback period */
+    int playback_latency;       /* ms fed ahead of the client */
+    int playback_rate;          /* 0 for the best the client takes */
     char smartcard_file[PATH_MAX];
 #endif /* XSPICE */
 
     uint32_t deferred_fps;
+    /* 128-bit hashes of what the device primary holds, two words per
+     * row of each SCROLL_BAND_WIDTH column band; all zero means unknown.
+     * Only kept in deferred fps mode, where the device is updated
+     * solely by us.
+     */
+    uint64_t *          scroll_hashes;
+    int                 scroll_bands;
+    int                 scroll_height;
+    /* A rectangle that keeps getting damaged every frame, which we
+     * hand to the server as a video stream
+     */
+    Bool                detect_video;
+    struct {
+	BoxRec          box;
+	int             hits;
+	int             misses;
+	Bool            active;
+	uint32_t        id;
+	uint32_t        frame;
+    } video;
+    /* Bookkeeping for the host shadow of the primary, whose memory
+     * is given back when parts of it go unused
+     */
+    qxl_shadow_t *      shadow;
     xorg_list_t ums_bos;
     struct qxl_bo_funcs *bo_funcs;
 
@@ -365,6 +434,10 @@ struct _qxl_screen_t
     drmmode_rec drmmode;
     int drm_fd;
     struct qxl_cmd_stream cmds;
+    /* Set when the kernel ran out of surface memory, cleared
+     * when we free a surface
+     */
+    Bool kms_surfaces_exhausted;
 #endif
 
 };
@@ -419,6 +492,8 @@ struct qxl_ring;
  * HW cursor
  */
 void              qxl_cursor_init        (ScreenPtr               pScreen);
+void              qxl_cursor_cache_clear (qxl_screen_t           *qxl);
+void              qxl_cursor_fini        (qxl_screen_t           *qxl);
 
 
 
@@ -448,6 +523,9 @@ surface_cache_t *   qxl_surface_cache_create (qxl_screen_t *qxl);
 qxl_surface_t *	    qxl_surface_cache_create_primary (qxl_screen_t *qxl,
 						struct QXLMode *mode);
 void *              qxl_surface_get_host_bits(qxl_surface_t *surface);
+pixman_image_t *    qxl_surface_create_shadow (qxl_screen_t *qxl,
+					       pixman_format_code_t format,
+					       int width, int height);
 qxl_surface_t *	    qxl_surface_create (qxl_screen_t *qxl,
 					int	      width,
 					int	      height,
@@ -498,8 +576,14 @@ void		    qxl_surface_copy	     (qxl_surface_t *dest,
 Bool		    qxl_surface_put_image    (qxl_surface_t *dest,
 					      int x, int y, int width, int height,
 					      const char *src, int src_pitch);
+Bool		    qxl_surface_get_image    (qxl_surface_t *surface,
+					      int x, int y, int width, int height,
+					      char *dst, int dst_pitch);
 void		    qxl_surface_unref        (surface_cache_t *cache,
 					      uint32_t surface_id);
+pixman_image_t *    qxl_surface_evict        (qxl_surface_t *surface);
+void		    qxl_surface_adopt        (qxl_surface_t *surface,
+					      pixman_image_t *image);
 
 /* composite */
 Bool		    qxl_surface_prepare_composite (int op,
@@ -546,6 +630,7 @@ get_ram_header (qxl_screen_t *qxl)
 }
 
 void qxl_surface_upload_primary_regions(qxl_screen_t *qxl, PixmapPtr pixmap, RegionRec *r);
+void qxl_surface_reset_scroll_hashes(qxl_screen_t *qxl);
 
 /* ums randr code */
 void qxl_init_randr (ScrnInfoPtr pScrn, qxl_screen_t *qxl);
@@ -569,6 +654,15 @@ struct qxl_bo *qxl_image_create     (qxl_screen_t           *qxl,
 				       int                     stride,
 				       int                     Bpp,
 				       Bool		       fallback);
+struct qxl_bo *qxl_image_create_frame (qxl_screen_t         *qxl,
+				       const uint8_t        *data,
+				       int                   x,
+				       int                   y,
+				       int                   width,
+				       int                   height,
+				       int                   stride,
+				       int                   Bpp,
+				       uint64_t              id);
 void              qxl_image_destroy    (qxl_screen_t           *qxl,
 				        struct qxl_bo *bo);
 
@@ -653,6 +747,8 @@ static inline void ioport_write(qxl_screen_t *qxl, int port, int val)
 #define TARGET_PAGE_BITS 12
 
 #define NUM_SURFACES 1024
+/* The most surfaces the spice server accepts */
+#define MAX_SURFACES 10000
 
 /* initializes if required and returns the server singleton */
 SpiceServer *xspice_get_spice_server(void);
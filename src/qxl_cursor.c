@@ -29,6 +29,7 @@
 
 #include <string.h>
 #include "qxl.h"
+#include "murmurhash3.h"
 #include <cursorstr.h>
 
 static void
@@ -50,21 +51,147 @@ qxl_alloc_cursor_cmd(qxl_screen_t *qxl)
 }
 
 static void
-qxl_set_cursor_position(ScrnInfoPtr pScrn, int x, int y)
+push_cursor_move (qxl_screen_t *qxl)
 {
-    qxl_screen_t *qxl = pScrn->driverPrivate;
     struct qxl_bo *cmd_bo = qxl_alloc_cursor_cmd(qxl);
     struct QXLCursorCmd *cmd = qxl->bo_funcs->bo_map(cmd_bo);
 
-    qxl->cur_x = x;
-    qxl->cur_y = y;
-    
     cmd->type = QXL_CURSOR_MOVE;
     cmd->u.position.x = qxl->cur_x + qxl->hot_x;
     cmd->u.position.y = qxl->cur_y + qxl->hot_y;
     
     qxl->bo_funcs->bo_unmap(cmd_bo);
     push_cursor(qxl, cmd_bo);
+
+    qxl->cursor_move_pending = FALSE;
+}
+
+/* Keeps qxl_set_cursor_position() out while we look at the position */
+static void
+cursor_lock (void)
+{
+#if GET_ABI_MAJOR(ABI_VIDEODRV_VERSION) >= 23
+    input_lock ();
+#else
+    OsBlockSIGIO ();
+#endif
+}
+
+static void
+cursor_unlock (void)
+{
+#if GET_ABI_MAJOR(ABI_VIDEODRV_VERSION) >= 23
+    input_unlock ();
+#else
+    OsReleaseSIGIO ();
+#endif
+}
+
+static CARD32
+cursor_move_timer_callback (OsTimerPtr timer, CARD32 time, pointer arg)
+{
+    qxl_screen_t *qxl = arg;
+
+    if (!qxl->cursor_move_pending)
+    {
+	/* The pointer stopped; send the next move right away */
+	qxl->cursor_move_timer_armed = FALSE;
+	return 0;
+    }
+
+    cursor_lock ();
+    push_cursor_move (qxl);
+    cursor_unlock ();
+
+    return 1000 / qxl->cursor_move_rate;
+}
+
+/* Stop any pending move from being sent */
+static void
+cancel_cursor_move (qxl_screen_t *qxl)
+{
+    if (qxl->cursor_move_timer)
+	TimerCancel (qxl->cursor_move_timer);
+
+    qxl->cursor_move_timer_armed = FALSE;
+    qxl->cursor_move_pending = FALSE;
+
+    cursor_lock ();
+    qxl->cursor_moved = FALSE;
+    cursor_unlock ();
+}
+
+static void
+queue_cursor_move (qxl_screen_t *qxl)
+{
+    if (qxl->cursor_move_rate <= 0)
+    {
+	push_cursor_move (qxl);
+	return;
+    }
+
+    /* The first move after the pointer has been still is sent at
+     * once. Moves that follow within 1 / cursor_move_rate seconds
+     * are collapsed into the latest position, which the timer sends.
+     */
+    if (qxl->cursor_move_timer_armed)
+    {
+	qxl->cursor_move_pending = TRUE;
+	return;
+    }
+
+    push_cursor_move (qxl);
+
+    qxl->cursor_move_timer = TimerSet (qxl->cursor_move_timer, 0,
+				       1000 / qxl->cursor_move_rate,
+				       cursor_move_timer_callback, qxl);
+    qxl->cursor_move_timer_armed = qxl->cursor_move_timer != NULL;
+}
+
+/* Runs in the main thread, where sending and arming timers is safe */
+#if GET_ABI_MAJOR(ABI_VIDEODRV_VERSION) >= 23
+static void
+cursor_block_handler (void *data, void *timeout)
+#else
+static void
+cursor_block_handler (pointer data, OSTimePtr timeout, pointer readmask)
+#endif
+{
+    qxl_screen_t *qxl = data;
+
+    cursor_lock ();
+    if (qxl->cursor_moved)
+    {
+	qxl->cursor_moved = FALSE;
+	queue_cursor_move (qxl);
+    }
+    cursor_unlock ();
+}
+
+void
+qxl_cursor_fini (qxl_screen_t *qxl)
+{
+    RemoveBlockAndWakeupHandlers (cursor_block_handler,
+				  (ServerWakeupHandlerProcPtr)NoopDDA, qxl);
+
+    cancel_cursor_move (qxl);
+
+    TimerFree (qxl->cursor_move_timer);
+    qxl->cursor_move_timer = NULL;
+}
+
+/* Before 1.19 this is called from the SIGIO handler, and from 1.19 on
+ * from the input thread, so it can't allocate, push or touch timers.
+ * Record the position and leave the rest to the block handler.
+ */
+static void
+qxl_set_cursor_position(ScrnInfoPtr pScrn, int x, int y)
+{
+    qxl_screen_t *qxl = pScrn->driverPrivate;
+
+    qxl->cur_x = x;
+    qxl->cur_y = y;
+    qxl->cursor_moved = TRUE;
 }
 
 static void
@@ -78,20 +205,103 @@ qxl_set_cursor_colors(ScrnInfoPtr pScrn, int bg, int fg)
     /* Should not be called since UseHWCursor returned FALSE */
 }
 
+/* The unique id lets spice-server and the client cache the shape,
+ * so it must be different for every shape we send.
+ */
+static uint64_t
+cursor_unique (CursorPtr pCurs)
+{
+    uint32_t key[4];
+    int size = pCurs->bits->width * pCurs->bits->height * sizeof (CARD32);
+    uint32_t hi, lo;
+    uint64_t unique;
+
+    key[0] = pCurs->bits->width;
+    key[1] = pCurs->bits->height;
+    key[2] = pCurs->bits->xhot;
+    key[3] = pCurs->bits->yhot;
+
+    MurmurHash3_x86_32 (key, sizeof (key), 0, &hi);
+    MurmurHash3_x86_32 (pCurs->bits->argb, size, hi, &hi);
+    MurmurHash3_x86_32 (pCurs->bits->argb, size, 0x5ec1a1, &lo);
+
+    unique = (uint64_t)hi << 32 | lo;
+
+    /* 0 means "don't cache" */
+    return unique ? unique : 1;
+}
+
+/* Returns a new reference to the cached cursor, or NULL */
+static struct qxl_bo *
+cursor_cache_lookup (qxl_screen_t *qxl, uint64_t unique)
+{
+    struct qxl_bo *bo;
+    int i;
+
+    for (i = 0; i < qxl->n_cached_cursors; ++i)
+    {
+	if (qxl->cursor_cache[i].unique == unique)
+	{
+	    bo = qxl->cursor_cache[i].bo;
+
+	    memmove (&qxl->cursor_cache[1], &qxl->cursor_cache[0],
+		     i * sizeof (qxl->cursor_cache[0]));
+	    qxl->cursor_cache[0].unique = unique;
+	    qxl->cursor_cache[0].bo = bo;
+
+	    qxl->bo_funcs->bo_incref (qxl, bo);
+	    qxl->cursor_cache_hits++;
+	    return bo;
+	}
+    }
+
+    qxl->cursor_cache_misses++;
+    return NULL;
+}
+
 static void
-qxl_load_cursor_argb (ScrnInfoPtr pScrn, CursorPtr pCurs)
+cursor_cache_add (qxl_screen_t *qxl, uint64_t unique, struct qxl_bo *bo)
+{
+    if (qxl->n_cached_cursors == N_CACHED_CURSORS)
+    {
+	qxl->bo_funcs->bo_decref (qxl, qxl->cursor_cache[N_CACHED_CURSORS - 1].bo);
+	qxl->n_cached_cursors--;
+    }
+
+    memmove (&qxl->cursor_cache[1], &qxl->cursor_cache[0],
+	     qxl->n_cached_cursors * sizeof (qxl->cursor_cache[0]));
+    qxl->cursor_cache[0].unique = unique;
+    qxl->cursor_cache[0].bo = bo;
+    qxl->n_cached_cursors++;
+
+    qxl->bo_funcs->bo_incref (qxl, bo);
+}
+
+/* Drop all cached shapes; the device memory they live in is about
+ * to go away.
+ */
+void
+qxl_cursor_cache_clear (qxl_screen_t *qxl)
+{
+    int i;
+
+    for (i = 0; i < qxl->n_cached_cursors; ++i)
+	qxl->bo_funcs->bo_decref (qxl, qxl->cursor_cache[i].bo);
+
+    qxl->n_cached_cursors = 0;
+}
+
+static struct qxl_bo *
+create_cursor_bo (qxl_screen_t *qxl, CursorPtr pCurs, uint64_t unique)
 {
-    qxl_screen_t *qxl = pScrn->driverPrivate;
     int w = pCurs->bits->width;
     int h = pCurs->bits->height;
     int size = w * h * sizeof (CARD32);
 
-    struct qxl_bo *cmd_bo = qxl_alloc_cursor_cmd(qxl);
-    struct QXLCursorCmd *cmd;
     struct qxl_bo *cursor_bo = qxl->bo_funcs->bo_alloc(qxl, sizeof(struct QXLCursor) + size, "cursor data");
     struct QXLCursor *cursor = qxl->bo_funcs->bo_map(cursor_bo);
 
-    cursor->header.unique = 0;
+    cursor->header.unique = unique;
     cursor->header.type = SPICE_CURSOR_TYPE_ALPHA;
     cursor->header.width = w;
     cursor->header.height = h;
@@ -125,6 +335,26 @@ qxl_load_cursor_argb (ScrnInfoPtr pScrn, CursorPtr pCurs)
 
     qxl->bo_funcs->bo_unmap(cursor_bo);
 
+    return cursor_bo;
+}
+
+static void
+qxl_load_cursor_argb (ScrnInfoPtr pScrn, CursorPtr pCurs)
+{
+    qxl_screen_t *qxl = pScrn->driverPrivate;
+    uint64_t unique = cursor_unique (pCurs);
+
+    struct qxl_bo *cmd_bo = qxl_alloc_cursor_cmd(qxl);
+    struct QXLCursorCmd *cmd;
+    struct qxl_bo *cursor_bo;
+
+    cursor_bo = cursor_cache_lookup (qxl, unique);
+    if (!cursor_bo)
+    {
+	cursor_bo = create_cursor_bo (qxl, pCurs, unique);
+	cursor_cache_add (qxl, unique, cursor_bo);
+    }
+
     qxl->hot_x = pCurs->bits->xhot;
     qxl->hot_y = pCurs->bits->yhot;
     
@@ -160,8 +390,14 @@ static void
 qxl_hide_cursor(ScrnInfoPtr pScrn)
 {
     qxl_screen_t *qxl = pScrn->driverPrivate;
-    struct qxl_bo *cmd_bo = qxl_alloc_cursor_cmd(qxl);
-    struct QXLCursorCmd *cursor = qxl->bo_funcs->bo_map(cmd_bo);
+    struct qxl_bo *cmd_bo;
+    struct QXLCursorCmd *cursor;
+
+    /* A move would show the cursor again */
+    cancel_cursor_move (qxl);
+
+    cmd_bo = qxl_alloc_cursor_cmd(qxl);
+    cursor = qxl->bo_funcs->bo_map(cmd_bo);
 
     cursor->type = QXL_CURSOR_HIDE;
 
@@ -178,7 +414,7 @@ qxl_show_cursor(ScrnInfoPtr pScrn)
      */
     qxl_screen_t *qxl = pScrn->driverPrivate;
     
-    qxl_set_cursor_position(pScrn, qxl->cur_x, qxl->cur_y);
+    push_cursor_move (qxl);
 }
 
 hidden void
@@ -202,5 +438,12 @@ qxl_cursor_init(ScreenPtr pScreen)
     cursor->ShowCursor = qxl_show_cursor;
 
     if (!xf86InitCursor(pScreen, cursor))
+    {
       free(cursor);
+      return;
+    }
+
+    RegisterBlockAndWakeupHandlers (cursor_block_handler,
+				    (ServerWakeupHandlerProcPtr)NoopDDA,
+				    xf86ScreenToScrn (pScreen)->driverPrivate);
 }
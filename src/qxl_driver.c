@@ -87,6 +87,10 @@ static const OptionInfoRec DefaultOptions[] =
       "NumHeads",                 OPTV_INTEGER, { 4 }, FALSE },
     { OPTION_SPICE_DEFERRED_FPS,
       "SpiceDeferredFPS",         OPTV_INTEGER, { 0 }, FALSE},
+    { OPTION_CURSOR_MOVE_RATE,
+      "CursorMoveRate",           OPTV_INTEGER, { 100 }, FALSE},
+    { OPTION_CURSOR_MOVE_FOLLOWS_FPS,
+      "CursorMoveFollowsFPS",     OPTV_BOOLEAN, { 0 }, FALSE},
 #ifdef XSPICE
     { OPTION_SPICE_PORT,
       "SpicePort",                OPTV_INTEGER,   {5900}, FALSE },
@@ -136,6 +140,12 @@ static const OptionInfoRec DefaultOptions[] =
       "SpiceExitOnDisconnect",    OPTV_BOOLEAN,   {0}, FALSE},
     { OPTION_SPICE_PLAYBACK_FIFO_DIR,
       "SpicePlaybackFIFODir",     OPTV_STRING,    {0}, FALSE},
+    { OPTION_SPICE_PLAYBACK_PERIOD,
+      "SpicePlaybackPeriod",      OPTV_INTEGER,   {10}, FALSE},
+    { OPTION_SPICE_PLAYBACK_LATENCY,
+      "SpicePlaybackLatency",     OPTV_INTEGER,   {80}, FALSE},
+    { OPTION_SPICE_PLAYBACK_RATE,
+      "SpicePlaybackRate",        OPTV_INTEGER,   {0}, FALSE},
     { OPTION_SPICE_VDAGENT_ENABLED,
       "SpiceVdagentEnabled",      OPTV_BOOLEAN,   {0}, FALSE},
     { OPTION_SPICE_VDAGENT_VIRTIO_PATH,
@@ -152,6 +162,8 @@ static const OptionInfoRec DefaultOptions[] =
       "SurfaceBufferSize",        OPTV_INTEGER,    {DEFAULT_SURFACE_BUFFER_SIZE}, FALSE},
     { OPTION_COMMAND_BUFFER_SIZE,
       "CommandBufferSize",        OPTV_INTEGER,    {DEFAULT_COMMAND_BUFFER_SIZE}, FALSE},
+    { OPTION_NUM_SURFACES,
+      "NumSurfaces",              OPTV_INTEGER,    {NUM_SURFACES}, FALSE},
     { OPTION_SPICE_SMARTCARD_FILE,
       "SpiceSmartcardFile",       OPTV_STRING,    {0}, FALSE},
     { OPTION_SPICE_VIDEO_CODECS,
@@ -467,6 +479,22 @@ qxl_close_screen (CLOSE_SCREEN_ARGS_DECL)
     pScrn->EnableDisableFBAccess (pScrn, FALSE);
 #endif
     
+    xf86DrvMsg (pScrn->scrnIndex, X_INFO, "Cursor cache: %u hits, %u misses\n",
+                qxl->cursor_cache_hits, qxl->cursor_cache_misses);
+    xf86DrvMsg (pScrn->scrnIndex, X_INFO,
+                "Pixmaps: %u placed on device, %u in host memory, "
+                "%u moved to host, %u moved to device\n",
+                qxl->placed_on_device, qxl->placed_on_host,
+                qxl->moved_to_host, qxl->moved_to_device);
+#ifdef XSPICE
+    qxl_playback_log_stats (qxl);
+#endif
+    qxl_cursor_cache_clear (qxl);
+    qxl_cursor_fini (qxl);
+    qxl_surface_reset_scroll_hashes (qxl);
+    dfps_stop_ticker (qxl);
+    qxl_timer_fini ();
+
     pScreen->CreateScreenResources = qxl->create_screen_resources;
     pScreen->CloseScreen = qxl->close_screen;
     
@@ -563,6 +591,7 @@ qxl_resize_primary_to_virtual (qxl_screen_t *qxl)
     }
     
     qxl->primary = qxl_create_primary(qxl);
+    qxl_surface_reset_scroll_hashes (qxl);
     qxl->bytes_per_pixel = (qxl->pScrn->bitsPerPixel + 7) / 8;
     
     if (qxl->screen_resources_created)
@@ -881,6 +910,9 @@ qxl_leave_vt (VT_FUNC_ARGS_DECL)
     
     xf86_hide_cursors (pScrn);
 
+    /* The cached shapes live in memory that is reset on EnterVT */
+    qxl_cursor_cache_clear (qxl);
+
     pScrn->EnableDisableFBAccess (XF86_SCRN_ARG (pScrn), FALSE);
 
     if (qxl->deferred_fps <= 0)
@@ -1011,6 +1043,19 @@ qxl_pre_init_common(ScrnInfoPtr pScrn)
         xf86DrvMsg(scrnIndex, X_INFO, "Deferred FPS: %d\n", qxl->deferred_fps);
     else
         xf86DrvMsg(scrnIndex, X_INFO, "Deferred Frames: Disabled\n");
+    qxl->detect_video = qxl->deferred_fps > 0;
+
+    qxl->cursor_move_rate =
+        get_int_option (qxl->options, OPTION_CURSOR_MOVE_RATE, "QXL_CURSOR_MOVE_RATE");
+    if (qxl->deferred_fps > 0 &&
+        get_bool_option (qxl->options, OPTION_CURSOR_MOVE_FOLLOWS_FPS, "QXL_CURSOR_MOVE_FOLLOWS_FPS"))
+        qxl->cursor_move_rate = qxl->deferred_fps;
+    if (qxl->cursor_move_rate > 1000)
+        qxl->cursor_move_rate = 1000;
+    if (qxl->cursor_move_rate > 0)
+        xf86DrvMsg(scrnIndex, X_INFO, "Cursor Moves: %d per second\n", qxl->cursor_move_rate);
+    else
+        xf86DrvMsg(scrnIndex, X_INFO, "Cursor Moves: Unlimited\n");
 
     xf86DrvMsg (scrnIndex, X_INFO, "Offscreen Surfaces: %s\n",
                 qxl->enable_surfaces ? "Enabled" : "Disabled");
@@ -1036,6 +1081,7 @@ qxl_pre_init (ScrnInfoPtr pScrn, int flags)
 #ifdef XSPICE
     const char *playback_fifo_dir;
     const char *smartcard_file;
+    const char *streaming_video;
 #endif
 
     /* In X server 1.7.5, Xorg -configure will cause this
@@ -1091,6 +1137,49 @@ qxl_pre_init (ScrnInfoPtr pScrn, int flags)
     else
         qxl->playback_fifo_dir[0] = '\0';
 
+    qxl->playback_period =
+        get_int_option (qxl->options, OPTION_SPICE_PLAYBACK_PERIOD, "XSPICE_PLAYBACK_PERIOD");
+    if (qxl->playback_period < 5 || qxl->playback_period > 40)
+    {
+        xf86DrvMsg (scrnIndex, X_WARNING,
+                    "SpicePlaybackPeriod must be between 5 and 40 ms, using 10\n");
+        qxl->playback_period = 10;
+    }
+    qxl->playback_latency =
+        get_int_option (qxl->options, OPTION_SPICE_PLAYBACK_LATENCY, "XSPICE_PLAYBACK_LATENCY");
+    if (qxl->playback_latency < 2 * qxl->playback_period || qxl->playback_latency > 1000)
+    {
+        xf86DrvMsg (scrnIndex, X_WARNING,
+                    "SpicePlaybackLatency must be between two periods and 1000 ms, using %d\n",
+                    8 * qxl->playback_period);
+        qxl->playback_latency = 8 * qxl->playback_period;
+    }
+    qxl->playback_rate =
+        get_int_option (qxl->options, OPTION_SPICE_PLAYBACK_RATE, "XSPICE_PLAYBACK_RATE");
+    /* spice-server only encodes these with Opus; other rates go out
+     * as raw PCM, which costs more than the rate saves */
+    switch (qxl->playback_rate)
+    {
+    case 0:
+    case 8000:
+    case 12000:
+    case 16000:
+    case 24000:
+    case 48000:
+        break;
+    default:
+        xf86DrvMsg (scrnIndex, X_WARNING,
+                    "SpicePlaybackRate must be 8000, 12000, 16000, 24000 or "
+                    "48000 Hz, using the best the client supports\n");
+        qxl->playback_rate = 0;
+        break;
+    }
+
+    streaming_video = get_str_option(qxl->options, OPTION_SPICE_STREAMING_VIDEO,
+               "XSPICE_STREAMING_VIDEO");
+    if (streaming_video && strcmp(streaming_video, "off") == 0)
+        qxl->detect_video = FALSE;
+
     smartcard_file = get_str_option(qxl->options, OPTION_SPICE_SMARTCARD_FILE,
                "XSPICE_SMARTCARD_FILE");
     if (smartcard_file)
@@ -1104,6 +1193,15 @@ qxl_pre_init (ScrnInfoPtr pScrn, int flags)
         get_int_option (qxl->options, OPTION_SURFACE_BUFFER_SIZE, "QXL_SURFACE_BUFFER_SIZE") << 20L;
     qxl->ram_size =
         get_int_option (qxl->options, OPTION_COMMAND_BUFFER_SIZE, "QXL_COMMAND_BUFFER_SIZE") << 20L;
+    qxl->n_surfaces =
+        get_int_option (qxl->options, OPTION_NUM_SURFACES, "QXL_NUM_SURFACES");
+    if (qxl->n_surfaces < 2 || qxl->n_surfaces > MAX_SURFACES)
+    {
+        xf86DrvMsg (scrnIndex, X_WARNING,
+                    "NumSurfaces must be between 2 and %d, using %d\n",
+                    MAX_SURFACES, NUM_SURFACES);
+        qxl->n_surfaces = NUM_SURFACES;
+    }
 #endif
 
     if (!qxl_map_memory (qxl, scrnIndex))
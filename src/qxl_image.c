@@ -37,11 +37,64 @@
 #include "qxl.h"
 #include "murmurhash3.h"
 
-static unsigned int
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Images at least this big are copied with non-temporal stores, so
+ * that uploading large frames doesn't push everything else out of
+ * the CPU caches; nothing reads the device copy back.
+ */
+#define STREAMING_COPY_SIZE (256 * 1024)
+
+#ifdef __SSE2__
+static void
+stream_copy (uint8_t *dest, const uint8_t *src, int n_bytes)
+{
+    while (((uintptr_t)dest & 15) && n_bytes)
+    {
+	*dest++ = *src++;
+	n_bytes--;
+    }
+
+    while (n_bytes >= 64)
+    {
+	__m128i a = _mm_loadu_si128 ((const __m128i *)src + 0);
+	__m128i b = _mm_loadu_si128 ((const __m128i *)src + 1);
+	__m128i c = _mm_loadu_si128 ((const __m128i *)src + 2);
+	__m128i d = _mm_loadu_si128 ((const __m128i *)src + 3);
+
+	_mm_stream_si128 ((__m128i *)dest + 0, a);
+	_mm_stream_si128 ((__m128i *)dest + 1, b);
+	_mm_stream_si128 ((__m128i *)dest + 2, c);
+	_mm_stream_si128 ((__m128i *)dest + 3, d);
+
+	src += 64;
+	dest += 64;
+	n_bytes -= 64;
+    }
+
+    while (n_bytes >= 16)
+    {
+	_mm_stream_si128 ((__m128i *)dest, _mm_loadu_si128 ((const __m128i *)src));
+
+	src += 16;
+	dest += 16;
+	n_bytes -= 16;
+    }
+
+    memcpy (dest, src, n_bytes);
+}
+#endif
+
+/* Copies the lines and, if hash is not NULL, hashes them while they
+ * are still in the cache.
+ */
+static void
 hash_and_copy (const uint8_t *src, int src_stride,
 	       uint8_t *dest, int dest_stride,
 	       int bytes_per_pixel, int width, int height,
-	       uint32_t hash)
+	       Bool streaming, uint32_t *hash)
 {
     int i;
   
@@ -53,19 +106,22 @@ hash_and_copy (const uint8_t *src, int src_stride,
 	if (n_bytes > src_stride)
 	    n_bytes = src_stride;
 
-	if (dest)
+#ifdef __SSE2__
+	if (streaming)
+	    stream_copy (dest_line, src_line, n_bytes);
+	else
+#endif
 	    memcpy (dest_line, src_line, n_bytes);
 
-	MurmurHash3_x86_32 (src_line, n_bytes, hash, &hash);
+	if (hash)
+	    MurmurHash3_x86_32 (src_line, n_bytes, *hash, hash);
     }
-
-    return hash;
 }
 
-struct qxl_bo *
-qxl_image_create (qxl_screen_t *qxl, const uint8_t *data,
-		  int x, int y, int width, int height,
-		  int stride, int Bpp, Bool fallback)
+static struct qxl_bo *
+create_image (qxl_screen_t *qxl, const uint8_t *data,
+	      int x, int y, int width, int height,
+	      int stride, int Bpp, Bool cache, uint64_t id)
 {
 	uint32_t hash;
 	struct QXLImage *image;
@@ -74,6 +130,7 @@ qxl_image_create (qxl_screen_t *qxl, const uint8_t *data,
 	int dest_stride = (width * Bpp + 3) & (~3);
 	int h;
 	int chunk_size;
+	Bool streaming = (dest_stride * height >= STREAMING_COPY_SIZE);
 
 	data += y * stride + x * Bpp;
 
@@ -113,9 +170,10 @@ qxl_image_create (qxl_screen_t *qxl, const uint8_t *data,
 
 	    QXLDataChunk *chunk = qxl->bo_funcs->bo_map(bo);
 	    chunk->data_size = n_lines * dest_stride;
-	    hash = hash_and_copy (data, stride,
-				  chunk->data, dest_stride,
-				  Bpp, width, n_lines, hash);
+	    hash_and_copy (data, stride,
+			   chunk->data, dest_stride,
+			   Bpp, width, n_lines, streaming,
+			   cache ? &hash : NULL);
 	    
 	    if (tail_bo)
 	    {
@@ -142,11 +200,17 @@ qxl_image_create (qxl_screen_t *qxl, const uint8_t *data,
 	    h -= n_lines;
 	}
 
+#ifdef __SSE2__
+	/* Streaming stores must be visible before the command is */
+	if (streaming)
+	    _mm_sfence ();
+#endif
+
 	/* Image */
 	image_bo = qxl->bo_funcs->bo_alloc (qxl, sizeof *image, "image struct");
 	image = qxl->bo_funcs->bo_map(image_bo);
 
-	image->descriptor.id = 0;
+	image->descriptor.id = id;
 	image->descriptor.type = SPICE_IMAGE_TYPE_BITMAP;
 	
 	image->descriptor.flags = 0;
@@ -180,8 +244,7 @@ qxl_image_create (qxl_screen_t *qxl, const uint8_t *data,
 
 	qxl->bo_funcs->bo_decref(qxl, head_bo);
 	/* Add to hash table if caching is enabled */
-	if ((fallback && qxl->enable_fallback_cache)	||
-	    (!fallback && qxl->enable_image_cache))
+	if (cache)
 	{
             image->descriptor.id = hash;
             image->descriptor.flags = QXL_IMAGE_CACHE;
@@ -194,6 +257,31 @@ qxl_image_create (qxl_screen_t *qxl, const uint8_t *data,
 	return image_bo;
 }
 
+struct qxl_bo *
+qxl_image_create (qxl_screen_t *qxl, const uint8_t *data,
+		  int x, int y, int width, int height,
+		  int stride, int Bpp, Bool fallback)
+{
+	Bool cache = ((fallback && qxl->enable_fallback_cache)	||
+		      (!fallback && qxl->enable_image_cache));
+
+	return create_image (qxl, data, x, y, width, height,
+			     stride, Bpp, cache, 0);
+}
+
+/* A frame of a video stream. These are never cached; each frame
+ * is new content, so hashing it would only cost time. The id lets
+ * the server tell frames of the same stream apart from other images.
+ */
+struct qxl_bo *
+qxl_image_create_frame (qxl_screen_t *qxl, const uint8_t *data,
+			int x, int y, int width, int height,
+			int stride, int Bpp, uint64_t id)
+{
+	return create_image (qxl, data, x, y, width, height,
+			     stride, Bpp, FALSE, id);
+}
+
 void
 qxl_image_destroy (qxl_screen_t *qxl,
 		   struct qxl_bo *image_bo)
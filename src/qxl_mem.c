@@ -348,6 +348,12 @@ qxl_garbage_collect_internal (qxl_screen_t *qxl, uint64_t id)
 	qxl_surface_cache_sanity_check (qxl->surface_cache);
     }
 
+    if (is_drawable && drawable->clip.type == SPICE_CLIP_TYPE_RECTS)
+    {
+	to_free = qxl_ums_lookup_phy_addr(qxl, drawable->clip.data);
+	qxl->bo_funcs->bo_decref (qxl, to_free);
+    }
+
     id = info->next;
 
     qxl->bo_funcs->bo_unmap(info_bo);
@@ -420,6 +426,11 @@ qxl_allocnf (qxl_screen_t *qxl, unsigned long size, const char *name)
     {
 #if 0
 	ErrorF ("eliminated memory (%d)\n", nth_oom++);
+#endif
+#ifdef XSPICE
+	/* have the spice worker push releases as they happen */
+	if (n_attempts == 0)
+	    __atomic_store_n (&qxl->release_waiting, 1, __ATOMIC_RELAXED);
 #endif
 	if (!qxl_garbage_collect (qxl))
 	{
@@ -437,6 +448,11 @@ qxl_allocnf (qxl_screen_t *qxl, unsigned long size, const char *name)
 	}
     }
 
+#ifdef XSPICE
+    if (__atomic_load_n (&qxl->release_waiting, __ATOMIC_RELAXED))
+	__atomic_store_n (&qxl->release_waiting, 0, __ATOMIC_RELAXED);
+#endif
+
     return result;
 }
 
@@ -112,7 +112,10 @@ qxl_ring_pop (struct qxl_ring *ring,
     volatile uint8_t *ring_elt;
     int idx;
 
-    if (header->cons == header->prod)
+    /* Acquire prod so the element, and anything the producer chained off
+     * it, is read only after it was published; release cons so the
+     * producer doesn't reuse the slot before we are done copying it. */
+    if (header->cons == __atomic_load_n (&header->prod, __ATOMIC_ACQUIRE))
 	return FALSE;
 
     idx = header->cons & (ring->n_elements - 1);
@@ -120,7 +123,7 @@ qxl_ring_pop (struct qxl_ring *ring,
 
     memcpy (element, (void *)ring_elt, ring->element_size);
 
-    header->cons++;
+    __atomic_store_n (&header->cons, header->cons + 1, __ATOMIC_RELEASE);
 
     return TRUE;
 }
@@ -24,8 +24,12 @@
 #include "config.h"
 #endif
 
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include "qxl.h"
 #include "qxl_surface.h"/* send anything pending to the other side */
+#include "murmurhash3.h"
 
 
 enum ROPDescriptor
@@ -43,10 +47,42 @@ enum ROPDescriptor
     ROPD_INVERS_RES = (1 <<10),
 };
 
+static struct qxl_bo *
+make_clip_rects (qxl_screen_t *qxl, RegionPtr clip)
+{
+    int n_rects = REGION_NUM_RECTS (clip);
+    BoxPtr boxes = REGION_RECTS (clip);
+    struct qxl_bo *clip_bo;
+    QXLClipRects *clip_rects;
+    QXLRect *rects;
+    int i;
+
+    clip_bo = qxl->bo_funcs->bo_alloc (
+	qxl, sizeof (QXLClipRects) + n_rects * sizeof (QXLRect), "clip rects");
+    clip_rects = qxl->bo_funcs->bo_map (clip_bo);
+
+    clip_rects->num_rects = n_rects;
+    clip_rects->chunk.data_size = n_rects * sizeof (QXLRect);
+    clip_rects->chunk.prev_chunk = 0;
+    clip_rects->chunk.next_chunk = 0;
+
+    rects = (QXLRect *)clip_rects->chunk.data;
+    for (i = 0; i < n_rects; ++i)
+    {
+	rects[i].left = boxes[i].x1;
+	rects[i].top = boxes[i].y1;
+	rects[i].right = boxes[i].x2;
+	rects[i].bottom = boxes[i].y2;
+    }
+
+    qxl->bo_funcs->bo_unmap (clip_bo);
+    return clip_bo;
+}
+
+/* The clip region, if any, must lie within rect */
 static struct qxl_bo *
 make_drawable (qxl_screen_t *qxl, qxl_surface_t *surf, uint8_t type,
-	       const struct QXLRect *rect
-	       /* , pRegion clip */)
+	       const struct QXLRect *rect, RegionPtr clip)
 {
     struct QXLDrawable *drawable;
     struct qxl_bo *draw_bo;
@@ -69,8 +105,22 @@ make_drawable (qxl_screen_t *qxl, qxl_surface_t *surf, uint8_t type,
     drawable->self_bitmap_area.left = 0;
     drawable->self_bitmap_area.bottom = 0;
     drawable->self_bitmap_area.right = 0;
-    /* FIXME: add clipping */
-    drawable->clip.type = SPICE_CLIP_TYPE_NONE;
+
+    /* A single box clip is the same as the bounding box */
+    if (clip && REGION_NUM_RECTS (clip) > 1)
+    {
+	struct qxl_bo *clip_bo = make_clip_rects (qxl, clip);
+
+	drawable->clip.type = SPICE_CLIP_TYPE_RECTS;
+	qxl->bo_funcs->bo_output_bo_reloc(qxl, offsetof(struct QXLDrawable, clip.data),
+					   draw_bo, clip_bo);
+	qxl->bo_funcs->bo_decref(qxl, clip_bo);
+    }
+    else
+    {
+	drawable->clip.type = SPICE_CLIP_TYPE_NONE;
+	drawable->clip.data = 0;
+    }
     
     /*
      * surfaces_dest[i] should apparently be filled out with the
@@ -102,12 +152,12 @@ push_drawable (qxl_screen_t *qxl, struct qxl_bo *drawable_bo)
 
 static void
 submit_fill (qxl_screen_t *qxl, qxl_surface_t *surf,
-	     const struct QXLRect *rect, uint32_t color)
+	     const struct QXLRect *rect, RegionPtr clip, uint32_t color)
 {
     struct qxl_bo *drawable_bo;
     struct QXLDrawable *drawable;
     
-    drawable_bo = make_drawable (qxl, surf, QXL_DRAW_FILL, rect);
+    drawable_bo = make_drawable (qxl, surf, QXL_DRAW_FILL, rect, clip);
     
     drawable = qxl->bo_funcs->bo_map(drawable_bo);
     drawable->u.fill.brush.type = SPICE_BRUSH_TYPE_SOLID;
@@ -123,16 +173,292 @@ submit_fill (qxl_screen_t *qxl, qxl_surface_t *surf,
     push_drawable (qxl, drawable_bo);
 }
 
-void
-qxl_surface_flush (qxl_surface_t *surface)
+/* opacity
+ *
+ * Compositing a source that is known to be opaque with OVER is the
+ * same as copying it, which is a lot cheaper for the server and the
+ * client. The flag can only be set by something that writes opaque
+ * pixels over the whole surface; anything that may write a
+ * translucent pixel clears it.
+ */
+static void
+mark_written (qxl_surface_t *surface, RegionPtr region, Bool opaque)
+{
+    BoxRec all;
+
+    if (surface->bpp != 32)
+	return;
+
+    all.x1 = 0;
+    all.y1 = 0;
+    all.x2 = qxl_surface_width (surface);
+    all.y2 = qxl_surface_height (surface);
+
+    if (!opaque)
+	surface->opaque = FALSE;
+    else if (RECT_IN_REGION (NULL, region, &all) == rgnIN)
+	surface->opaque = TRUE;
+}
+
+/* Pixel (x, y) of the region is at @data + (y - dy) * stride + (x - dx) * 4 */
+static Bool
+region_is_opaque (RegionPtr region, const uint8_t *data, int stride,
+		  int dx, int dy)
+{
+    int n_boxes = REGION_NUM_RECTS (region);
+    BoxPtr b = REGION_RECTS (region);
+    int x, y;
+
+    while (n_boxes--)
+    {
+	for (y = b->y1; y < b->y2; ++y)
+	{
+	    const uint32_t *p =
+		(const uint32_t *)(data + (y - dy) * stride) - dx;
+
+	    for (x = b->x1; x < b->x2; ++x)
+	    {
+		if ((p[x] & 0xff000000) != 0xff000000)
+		    return FALSE;
+	    }
+	}
+	b++;
+    }
+
+    return TRUE;
+}
+
+/* Updates the flag after @region was written from memory. The pixels
+ * are only looked at when that can make a difference.
+ */
+static void
+mark_uploaded (qxl_surface_t *surface, RegionPtr region,
+	       const uint8_t *data, int stride, int dx, int dy)
 {
-    ;
+    BoxRec all;
+    Bool opaque = FALSE;
+
+    if (surface->bpp != 32 || REGION_NIL (region))
+	return;
+
+    all.x1 = 0;
+    all.y1 = 0;
+    all.x2 = qxl_surface_width (surface);
+    all.y2 = qxl_surface_height (surface);
+
+    if (surface->opaque || RECT_IN_REGION (NULL, region, &all) == rgnIN)
+	opaque = region_is_opaque (region, data, stride, dx, dy);
+
+    mark_written (surface, region, opaque);
+}
+
+/* host shadow of the primary
+ *
+ * With a big virtual desktop most of the primary's shadow is never
+ * looked at, so it is mapped without backing and the kernel only
+ * provides pages for rows that get touched. The shadow is split in
+ * bands of rows; outside of deferred fps mode its contents are only
+ * meaningful between prepare_access and finish_access, so bands that
+ * have not been accessed for a while are handed back to the kernel.
+ * A linear image can't give back anything narrower than full rows.
+ */
+#define SHADOW_BAND_ROWS 64
+#define SHADOW_IDLE_MS 2000
+
+struct qxl_shadow_t
+{
+    qxl_screen_t *	qxl;
+    uint8_t *		bits;
+    size_t		size;
+    int			stride;
+    int			n_bands;
+    CARD32		last_scan;
+    CARD32 *		last_used;	/* 0 when the band is released */
+};
+
+static void
+destroy_shadow (pixman_image_t *image, void *data)
+{
+    qxl_shadow_t *shadow = data;
+
+    munmap (shadow->bits, shadow->size);
+
+    if (shadow->qxl->shadow == shadow)
+	shadow->qxl->shadow = NULL;
+
+    free (shadow->last_used);
+    free (shadow);
+}
+
+pixman_image_t *
+qxl_surface_create_shadow (qxl_screen_t *qxl, pixman_format_code_t format,
+			   int width, int height)
+{
+    int stride = ((width * PIXMAN_FORMAT_BPP (format) + 0x1f) >> 5) * 4;
+    qxl_shadow_t *shadow;
+    pixman_image_t *image;
+    void *bits;
+
+    if (!(shadow = calloc (1, sizeof *shadow)))
+	goto fallback;
+
+    shadow->n_bands = (height + SHADOW_BAND_ROWS - 1) / SHADOW_BAND_ROWS;
+    shadow->last_used = calloc (shadow->n_bands, sizeof (CARD32));
+    shadow->size = (size_t)stride * height;
+
+    bits = mmap (NULL, shadow->size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (!shadow->last_used || shadow->size == 0 || bits == MAP_FAILED)
+    {
+	if (shadow->size && bits != MAP_FAILED)
+	    munmap (bits, shadow->size);
+	free (shadow->last_used);
+	free (shadow);
+	goto fallback;
+    }
+
+    image = pixman_image_create_bits (format, width, height, bits, stride);
+    if (!image)
+    {
+	munmap (bits, shadow->size);
+	free (shadow->last_used);
+	free (shadow);
+	return NULL;
+    }
+
+    shadow->qxl = qxl;
+    shadow->bits = bits;
+    shadow->stride = stride;
+    shadow->last_scan = GetTimeInMillis ();
+    pixman_image_set_destroy_function (image, destroy_shadow, shadow);
+
+    qxl->shadow = shadow;
+
+    return image;
+
+fallback:
+    return pixman_image_create_bits (format, width, height, NULL, -1);
+}
+
+static void
+touch_shadow (qxl_surface_t *surface, const BoxRec *extents)
+{
+    qxl_shadow_t *shadow = surface->qxl->shadow;
+    CARD32 now = GetTimeInMillis ();
+    int b, b1, b2;
+
+    if (!shadow || surface != surface->qxl->primary)
+	return;
+
+    /* 0 marks released bands */
+    if (now == 0)
+	now = 1;
+
+    b1 = max (extents->y1, 0) / SHADOW_BAND_ROWS;
+    b2 = (extents->y2 + SHADOW_BAND_ROWS - 1) / SHADOW_BAND_ROWS;
+    b2 = min (b2, shadow->n_bands);
+
+    for (b = b1; b < b2; ++b)
+	shadow->last_used[b] = now;
+}
+
+static Bool
+band_idle (qxl_shadow_t *shadow, int band, CARD32 now)
+{
+    return shadow->last_used[band] == 0 ||
+	(CARD32)(now - shadow->last_used[band]) >= SHADOW_IDLE_MS;
+}
+
+static void
+release_idle_shadow (qxl_surface_t *surface)
+{
+    qxl_screen_t *qxl = surface->qxl;
+    qxl_shadow_t *shadow = qxl->shadow;
+    uintptr_t page = sysconf (_SC_PAGESIZE);
+    CARD32 now = GetTimeInMillis ();
+    int b = 0;
+
+    /* Under deferred fps the shadow is the frame buffer itself */
+    if (!shadow || surface != qxl->primary || qxl->deferred_fps > 0)
+	return;
+
+    if ((CARD32)(now - shadow->last_scan) < SHADOW_IDLE_MS / 2)
+	return;
+
+    shadow->last_scan = now;
+
+    /* Bands don't end on page boundaries, so release whole runs of
+     * idle bands; pages shared with a band in use are kept.
+     */
+    while (b < shadow->n_bands)
+    {
+	uintptr_t start, end;
+	Bool stale = FALSE;
+	int first = b;
+
+	if (!band_idle (shadow, b, now))
+	{
+	    b++;
+	    continue;
+	}
+
+	while (b < shadow->n_bands && band_idle (shadow, b, now))
+	{
+	    if (shadow->last_used[b])
+		stale = TRUE;
+	    shadow->last_used[b++] = 0;
+	}
+
+	if (!stale)
+	    continue;
+
+	start = (uintptr_t)shadow->bits +
+	    (size_t)first * SHADOW_BAND_ROWS * shadow->stride;
+	start = (start + page - 1) & ~(page - 1);
+
+	if (b == shadow->n_bands)
+	{
+	    end = (uintptr_t)shadow->bits + shadow->size;
+	    end = (end + page - 1) & ~(page - 1);
+	}
+	else
+	{
+	    end = (uintptr_t)shadow->bits +
+		(size_t)b * SHADOW_BAND_ROWS * shadow->stride;
+	    end &= ~(page - 1);
+	}
+
+	if (start < end)
+	    madvise ((void *)start, end - start, MADV_DONTNEED);
+    }
 }
 
 /* access */
+
+/* Surfaces that are only ever rendered by the device never need host
+ * memory, so it is only allocated when software first looks at them.
+ */
+static Bool
+ensure_host_image (qxl_surface_t *surface)
+{
+    if (!surface->host_image)
+    {
+	surface->host_image = pixman_image_create_bits (
+	    pixman_image_get_format (surface->dev_image),
+	    qxl_surface_width (surface), qxl_surface_height (surface),
+	    NULL, -1);
+    }
+
+    return surface->host_image != NULL;
+}
+
 static void
 download_box_no_update (qxl_surface_t *surface, int x1, int y1, int x2, int y2)
 {
+    if (!ensure_host_image (surface))
+	return;
+
     pixman_image_composite (PIXMAN_OP_SRC,
                             surface->dev_image,
                             NULL,
@@ -153,6 +479,94 @@ qxl_download_box (qxl_surface_t *surface, int x1, int y1, int x2, int y2)
     download_box_no_update(surface, x1, y1, x2, y2);
 }
 
+/* Fallbacks that don't tell us what they write are checked for
+ * changes in tiles of this size before being uploaded. A collision
+ * would drop a real write for good, so the hashes are 128 bits wide.
+ */
+#define HASH_TILE_SIZE 64
+
+static void
+hash_tile (qxl_surface_t *surface, int x1, int y1, int x2, int y2,
+	   uint64_t hash[2])
+{
+    uint8_t *data = (uint8_t *)pixman_image_get_data (surface->host_image);
+    int stride = pixman_image_get_stride (surface->host_image);
+    int Bpp = surface->bpp == 24 ? 4 : surface->bpp / 8;
+    uint64_t rows[HASH_TILE_SIZE][2];
+    int y;
+
+    /* Tile rows aren't contiguous; hash them one by one, then hash
+     * the row hashes */
+    for (y = y1; y < y2; ++y)
+    {
+	MurmurHash3_x64_128 (data + y * stride + x1 * Bpp,
+			     (x2 - x1) * Bpp, 0, rows[y - y1]);
+    }
+
+    MurmurHash3_x64_128 (rows, (y2 - y1) * sizeof (rows[0]), 0, hash);
+}
+
+/* Calls func on every tile of the host image; returns the number of tiles */
+static int
+for_each_tile (qxl_surface_t *surface,
+	       void (* func) (qxl_surface_t *surface, int i,
+			      int x1, int y1, int x2, int y2, void *data),
+	       void *data)
+{
+    int w = qxl_surface_width (surface);
+    int h = qxl_surface_height (surface);
+    int x, y, i = 0;
+
+    for (y = 0; y < h; y += HASH_TILE_SIZE)
+    {
+	for (x = 0; x < w; x += HASH_TILE_SIZE)
+	{
+	    if (func)
+	    {
+		func (surface, i, x, y,
+		      min (x + HASH_TILE_SIZE, w), min (y + HASH_TILE_SIZE, h),
+		      data);
+	    }
+	    i++;
+	}
+    }
+
+    return i;
+}
+
+static void
+store_tile_hash (qxl_surface_t *surface, int i,
+		 int x1, int y1, int x2, int y2, void *data)
+{
+    hash_tile (surface, x1, y1, x2, y2, &surface->tile_hashes[2 * i]);
+}
+
+static void
+add_changed_tile (qxl_surface_t *surface, int i,
+		  int x1, int y1, int x2, int y2, void *data)
+{
+    RegionPtr changed = data;
+    RegionRec tile;
+    BoxRec box;
+    uint64_t hash[2];
+
+    hash_tile (surface, x1, y1, x2, y2, hash);
+    if (surface->tile_hashes[2 * i] == hash[0] &&
+	surface->tile_hashes[2 * i + 1] == hash[1])
+    {
+	return;
+    }
+
+    box.x1 = x1;
+    box.y1 = y1;
+    box.x2 = x2;
+    box.y2 = y2;
+
+    REGION_INIT (NULL, &tile, &box, 1);
+    REGION_UNION (NULL, changed, changed, &tile);
+    REGION_UNINIT (NULL, &tile);
+}
+
 Bool
 qxl_surface_prepare_access (qxl_surface_t  *surface,
 			    PixmapPtr       pixmap,
@@ -164,15 +578,40 @@ qxl_surface_prepare_access (qxl_surface_t  *surface,
     ScreenPtr pScreen = pixmap->drawable.pScreen;
     ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
     RegionRec new;
+    BoxRec all;
+    Bool hash_tiles = FALSE;
 
     if (!pScrn->vtSema)
         return FALSE;
 
+    if (!ensure_host_image (surface))
+	return FALSE;
+
+    qxl_surface_flush (surface);
+
+    touch_shadow (surface, REGION_EXTENTS (NULL, region));
+
     REGION_INIT (NULL, &new, (BoxPtr)NULL, 0);
     REGION_SUBTRACT (NULL, &new, region, &surface->access_region);
 
     if (access == UXA_ACCESS_RW)
+    {
 	surface->access_type = UXA_ACCESS_RW;
+
+	/* UXA passes the damage of the fallback, or the whole pixmap
+	 * when it doesn't know. In the latter case remember what the
+	 * tiles looked like so that only the changed ones get uploaded.
+	 */
+	all.x1 = 0;
+	all.y1 = 0;
+	all.x2 = pixmap->drawable.width;
+	all.y2 = pixmap->drawable.height;
+
+	if (RECT_IN_REGION (NULL, region, &all) == rgnIN)
+	    hash_tiles = !surface->tile_hashes;
+	else
+	    REGION_UNION (NULL, &surface->write_region, &surface->write_region, region);
+    }
     
     region = &new;
     
@@ -201,6 +640,17 @@ qxl_surface_prepare_access (qxl_surface_t  *surface,
 		      region);
     
     REGION_UNINIT (NULL, &new);
+
+    if (hash_tiles)
+    {
+	surface->tile_hashes = malloc (
+	    for_each_tile (surface, NULL, NULL) * 2 * sizeof (uint64_t));
+
+	if (surface->tile_hashes)
+	    for_each_tile (surface, store_tile_hash, NULL);
+	else
+	    REGION_UNION (NULL, &surface->write_region, &surface->write_region, &surface->access_region);
+    }
     
     pScreen->ModifyPixmapHeader(
 	pixmap,
@@ -237,7 +687,7 @@ real_upload_box (qxl_surface_t *surface, int x1, int y1, int x2, int y2)
     rect.top = y1;
     rect.bottom = y2;
     
-    drawable_bo = make_drawable (qxl, surface, QXL_DRAW_COPY, &rect);
+    drawable_bo = make_drawable (qxl, surface, QXL_DRAW_COPY, &rect, NULL);
     drawable = qxl->bo_funcs->bo_map(drawable_bo);
     drawable->u.copy.src_area = rect;
     translate_rect (&drawable->u.copy.src_area);
@@ -278,55 +728,452 @@ qxl_upload_box (qxl_surface_t *surface, int x1, int y1, int x2, int y2)
 	    int tile_x2 = tile_x1 + TILE_WIDTH;
 	    int tile_y2 = tile_y1 + TILE_HEIGHT;
 
-	    if (tile_x2 > x2)
-		tile_x2 = x2;
-	    if (tile_y2 > y2)
-		tile_y2 = y2;
+	    if (tile_x2 > x2)
+		tile_x2 = x2;
+	    if (tile_y2 > y2)
+		tile_y2 = y2;
+
+	    real_upload_box (surface, tile_x1, tile_y1, tile_x2, tile_y2);
+	}
+    }
+}
+
+/* A non-zero @frame_id uploads the box as a frame of a video stream */
+static void
+upload_one_primary_region(qxl_screen_t *qxl, PixmapPtr pixmap, BoxPtr b,
+			  uint64_t frame_id)
+{
+    struct QXLRect rect;
+    struct qxl_bo *drawable_bo, *image_bo;
+    struct QXLDrawable *drawable;
+    FbBits *data;
+    int stride;
+    int bpp;
+
+    if (b->x1 >= qxl->virtual_x || b->y1 >= qxl->virtual_y)
+        return;
+
+    rect.left = b->x1;
+    rect.right = min(b->x2, qxl->virtual_x);
+    rect.top = b->y1;
+    rect.bottom = min(b->y2, qxl->virtual_y);
+
+    drawable_bo = make_drawable (qxl, qxl->primary, QXL_DRAW_COPY, &rect, NULL);
+    drawable = qxl->bo_funcs->bo_map(drawable_bo);
+    drawable->u.copy.src_area = rect;
+    translate_rect (&drawable->u.copy.src_area);
+    drawable->u.copy.rop_descriptor = ROPD_OP_PUT;
+    drawable->u.copy.scale_mode = 0;
+    drawable->u.copy.mask.flags = 0;
+    drawable->u.copy.mask.pos.x = 0;
+    drawable->u.copy.mask.pos.y = 0;
+    drawable->u.copy.mask.bitmap = 0;
+    qxl->bo_funcs->bo_unmap(drawable_bo);
+
+    fbGetPixmapBitsData(pixmap, data, stride, bpp);
+    if (frame_id)
+    {
+	image_bo = qxl_image_create_frame (
+	    qxl, (const uint8_t *)data, rect.left, rect.top, rect.right - rect.left, rect.bottom - rect.top, stride * sizeof(*data),
+	    bpp == 24 ? 4 : bpp / 8, frame_id);
+    }
+    else
+    {
+	image_bo = qxl_image_create (
+	    qxl, (const uint8_t *)data, rect.left, rect.top, rect.right - rect.left, rect.bottom - rect.top, stride * sizeof(*data),
+	    bpp == 24 ? 4 : bpp / 8, TRUE);
+    }
+    qxl->bo_funcs->bo_output_bo_reloc(qxl, offsetof(QXLDrawable, u.copy.src_bitmap),
+				   drawable_bo, image_bo);
+
+    push_drawable (qxl, drawable_bo);
+    qxl->bo_funcs->bo_decref(qxl, image_bo);
+}
+
+/* Scroll detection
+ *
+ * In deferred fps mode the device primary only changes through the
+ * uploads below, so we can remember a hash of every row it holds. When
+ * an updated box turns out to be mostly rows that the device already
+ * has, shifted vertically, we move them there with a single COPY_BITS
+ * and only upload what is actually new.
+ */
+#define SCROLL_BAND_WIDTH 64
+#define SCROLL_MIN_SIZE 64
+
+void
+qxl_surface_reset_scroll_hashes (qxl_screen_t *qxl)
+{
+    free (qxl->scroll_hashes);
+    qxl->scroll_hashes = NULL;
+    qxl->scroll_bands = 0;
+    qxl->scroll_height = 0;
+}
+
+static int
+band_end (qxl_screen_t *qxl, int band)
+{
+    return min ((band + 1) * SCROLL_BAND_WIDTH, qxl->virtual_x);
+}
+
+/* A row that matches on its hash is moved without looking at the
+ * pixels, so the hashes are as wide as the tile hashes
+ */
+static void
+hash_band_row (const uint8_t *data, int stride, int Bpp, int x1, int x2, int y,
+	       uint64_t hash[2])
+{
+    MurmurHash3_x64_128 (data + y * stride + x1 * Bpp, (x2 - x1) * Bpp, 0, hash);
+
+    /* All zero is reserved for unknown rows */
+    if (!hash[0] && !hash[1])
+	hash[0] = 1;
+}
+
+static Bool
+rows_equal (const uint64_t *a, const uint64_t *b, int n)
+{
+    int i;
+
+    for (i = 0; i < 2 * n; i += 2)
+    {
+	if ((!a[i] && !a[i + 1]) || a[i] != b[i] || a[i + 1] != b[i + 1])
+	    return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Look for a vertical shift of the rows in [y1, y2) relative to what the
+ * device holds. Returns the source offset, or 0 if there is none.
+ */
+static int
+find_scroll (qxl_screen_t *qxl, const uint64_t *new_hashes,
+	     int b1, int nb, int y1, int y2)
+{
+    int h = y2 - y1;
+    int s;
+
+    for (s = 1; s < 4; ++s)
+    {
+	const uint64_t *row = new_hashes + (h * s / 4) * nb * 2;
+	int y = y1 + h * s / 4;
+	int d;
+
+	for (d = 1; d < h; ++d)
+	{
+	    if (y + d < y2 &&
+		rows_equal (qxl->scroll_hashes + ((y + d) * qxl->scroll_bands + b1) * 2, row, nb))
+	    {
+		return d;
+	    }
+
+	    if (y - d >= y1 &&
+		rows_equal (qxl->scroll_hashes + ((y - d) * qxl->scroll_bands + b1) * 2, row, nb))
+	    {
+		return -d;
+	    }
+	}
+    }
+
+    return 0;
+}
+
+static void
+submit_copy_bits (qxl_screen_t *qxl, const struct QXLRect *rect, int src_x, int src_y)
+{
+    struct qxl_bo *drawable_bo;
+    struct QXLDrawable *drawable;
+
+    drawable_bo = make_drawable (qxl, qxl->primary, QXL_COPY_BITS, rect, NULL);
+
+    drawable = qxl->bo_funcs->bo_map(drawable_bo);
+    drawable->u.copy_bits.src_pos.x = src_x;
+    drawable->u.copy_bits.src_pos.y = src_y;
+    qxl->bo_funcs->bo_unmap(drawable_bo);
+
+    push_drawable (qxl, drawable_bo);
+}
+
+/* Moves any scrolled rows of @box into place on the device and removes
+ * them from @remaining. Returns the freshly computed hashes of the bands
+ * fully inside @box, which the caller must free.
+ */
+static uint64_t *
+detect_scroll (qxl_screen_t *qxl, const uint8_t *data, int stride, int Bpp,
+	       BoxPtr box, RegionPtr remaining, int *b1_out, int *nb_out)
+{
+    uint64_t *new_hashes;
+    int b1, b2, nb;
+    int x1, x2, y, h;
+    int dy, dst_y1, dst_y2, n_matches;
+    RegionRec moved;
+
+    b1 = (box->x1 + SCROLL_BAND_WIDTH - 1) / SCROLL_BAND_WIDTH;
+    if (box->x2 == qxl->virtual_x)
+	b2 = qxl->scroll_bands;
+    else
+	b2 = box->x2 / SCROLL_BAND_WIDTH;
+    nb = b2 - b1;
+    h = box->y2 - box->y1;
+
+    *b1_out = b1;
+    *nb_out = nb;
+
+    if (nb <= 0)
+	return NULL;
+
+    new_hashes = malloc (h * nb * 2 * sizeof (uint64_t));
+    if (!new_hashes)
+	return NULL;
+
+    for (y = 0; y < h; ++y)
+    {
+	int b;
+
+	for (b = 0; b < nb; ++b)
+	{
+	    hash_band_row (data, stride, Bpp,
+			   (b1 + b) * SCROLL_BAND_WIDTH, band_end (qxl, b1 + b),
+			   box->y1 + y, new_hashes + (y * nb + b) * 2);
+	}
+    }
+
+    x1 = b1 * SCROLL_BAND_WIDTH;
+    x2 = band_end (qxl, b2 - 1);
+
+    if (x2 - x1 < SCROLL_MIN_SIZE || h < SCROLL_MIN_SIZE)
+	return new_hashes;
+
+    dy = find_scroll (qxl, new_hashes, b1, nb, box->y1, box->y2);
+    if (!dy)
+	return new_hashes;
+
+    /* Destination rows whose source is also inside the box */
+    dst_y1 = max (box->y1, box->y1 - dy);
+    dst_y2 = min (box->y2, box->y2 - dy);
+
+    REGION_INIT (NULL, &moved, (BoxPtr)NULL, 0);
+
+    n_matches = 0;
+    for (y = dst_y1; y < dst_y2; ++y)
+    {
+	const uint64_t *old =
+	    qxl->scroll_hashes + ((y + dy) * qxl->scroll_bands + b1) * 2;
+
+	if (rows_equal (old, new_hashes + (y - box->y1) * nb * 2, nb))
+	{
+	    BoxRec row;
+	    RegionRec r;
+
+	    row.x1 = x1;
+	    row.x2 = x2;
+	    row.y1 = y;
+	    row.y2 = y + 1;
+
+	    REGION_INIT (NULL, &r, &row, 1);
+	    REGION_UNION (NULL, &moved, &moved, &r);
+	    REGION_UNINIT (NULL, &r);
+
+	    n_matches++;
+	}
+    }
+
+    /* Not worth it unless most of the shifted rows are really there */
+    if (n_matches * 2 >= dst_y2 - dst_y1)
+    {
+	struct QXLRect rect;
+
+	rect.left = x1;
+	rect.right = x2;
+	rect.top = dst_y1;
+	rect.bottom = dst_y2;
+
+	submit_copy_bits (qxl, &rect, x1, dst_y1 + dy);
+
+	REGION_SUBTRACT (NULL, remaining, remaining, &moved);
+    }
+
+    REGION_UNINIT (NULL, &moved);
+
+    return new_hashes;
+}
+
+static void
+update_scroll_hashes (qxl_screen_t *qxl, BoxPtr box,
+		      const uint64_t *new_hashes, int b1, int nb)
+{
+    int first = box->x1 / SCROLL_BAND_WIDTH;
+    int last = (box->x2 - 1) / SCROLL_BAND_WIDTH;
+    int y, b;
+
+    for (y = box->y1; y < box->y2; ++y)
+    {
+	uint64_t *row = qxl->scroll_hashes + y * qxl->scroll_bands * 2;
+
+	/* Bands only partly covered by the box are no longer known */
+	for (b = first; b <= last; ++b)
+	{
+	    if (new_hashes && b >= b1 && b < b1 + nb)
+	    {
+		const uint64_t *hash =
+		    new_hashes + ((y - box->y1) * nb + b - b1) * 2;
+
+		row[2 * b] = hash[0];
+		row[2 * b + 1] = hash[1];
+	    }
+	    else
+	    {
+		row[2 * b] = 0;
+		row[2 * b + 1] = 0;
+	    }
+	}
+    }
+}
+
+static void
+upload_primary_box (qxl_screen_t *qxl, PixmapPtr pixmap, BoxPtr b)
+{
+    FbBits *data;
+    int stride, bpp, Bpp;
+    uint64_t *new_hashes;
+    int b1, nb;
+    BoxRec box;
+    RegionRec remaining;
+    int n_boxes;
+    BoxPtr boxes;
+
+    if (b->x1 >= qxl->virtual_x || b->y1 >= qxl->virtual_y)
+	return;
+
+    box.x1 = b->x1;
+    box.y1 = b->y1;
+    box.x2 = min (b->x2, qxl->virtual_x);
+    box.y2 = min (b->y2, qxl->virtual_y);
+
+    fbGetPixmapBitsData(pixmap, data, stride, bpp);
+    Bpp = bpp == 24 ? 4 : bpp / 8;
+
+    REGION_INIT (NULL, &remaining, &box, 1);
+
+    new_hashes = detect_scroll (qxl, (const uint8_t *)data, stride * sizeof(*data), Bpp,
+				&box, &remaining, &b1, &nb);
+
+    n_boxes = REGION_NUM_RECTS (&remaining);
+    boxes = REGION_RECTS (&remaining);
+    while (n_boxes--)
+	upload_one_primary_region (qxl, pixmap, boxes++, 0);
+
+    update_scroll_hashes (qxl, &box, new_hashes, b1, nb);
+
+    REGION_UNINIT (NULL, &remaining);
+    free (new_hashes);
+}
+
+/* Video detection
+ *
+ * A video playing in deferred fps mode shows up as the same rectangle
+ * being damaged on every tick. Once we have seen that for a while, we
+ * upload the whole rectangle each time as frames with identical
+ * geometry, a per stream id and fresh mm_time, which is what the
+ * server looks for when deciding to switch to a video codec.
+ */
+#define VIDEO_MIN_SIZE 96
+#define VIDEO_MIN_FRAMES 5
+#define VIDEO_MAX_MISSES 5
+
+static Bool
+box_equal (const BoxRec *a, const BoxRec *b)
+{
+    return a->x1 == b->x1 && a->y1 == b->y1 && a->x2 == b->x2 && a->y2 == b->y2;
+}
+
+/* Returns TRUE if the video rectangle was damaged in @r */
+static Bool
+track_video (qxl_screen_t *qxl, RegionPtr r)
+{
+    int n_boxes = REGION_NUM_RECTS (r);
+    BoxPtr boxes = REGION_RECTS (r);
+    BoxPtr candidate = NULL;
+    int i;
+
+    if (qxl->video.active)
+    {
+	/* Anything touching the stream is a new frame; we resend
+	 * the whole rectangle to keep the geometry stable.
+	 */
+	if (RECT_IN_REGION (NULL, r, &qxl->video.box) != rgnOUT)
+	{
+	    qxl->video.misses = 0;
+	    return TRUE;
+	}
+    }
+    else
+    {
+	for (i = 0; i < n_boxes; ++i)
+	{
+	    BoxPtr b = &boxes[i];
+
+	    if (b->x2 - b->x1 < VIDEO_MIN_SIZE || b->y2 - b->y1 < VIDEO_MIN_SIZE)
+		continue;
+
+	    if (qxl->video.hits && box_equal (b, &qxl->video.box))
+	    {
+		qxl->video.misses = 0;
+		if (++qxl->video.hits >= VIDEO_MIN_FRAMES)
+		{
+		    qxl->video.active = TRUE;
+		    qxl->video.id++;
+		    qxl->video.frame = 0;
+		    return TRUE;
+		}
+		return FALSE;
+	    }
 
-	    real_upload_box (surface, tile_x1, tile_y1, tile_x2, tile_y2);
+	    if (!candidate ||
+		(b->x2 - b->x1) * (b->y2 - b->y1) >
+		(candidate->x2 - candidate->x1) * (candidate->y2 - candidate->y1))
+	    {
+		candidate = b;
+	    }
 	}
     }
+
+    /* Videos usually run slower than the tick, so give it some slack */
+    if ((qxl->video.active || qxl->video.hits) &&
+	++qxl->video.misses < VIDEO_MAX_MISSES)
+    {
+	return FALSE;
+    }
+
+    /* Start over, either with a new candidate or with nothing */
+    qxl->video.active = FALSE;
+    qxl->video.misses = 0;
+    qxl->video.hits = candidate ? 1 : 0;
+    if (candidate)
+	qxl->video.box = *candidate;
+
+    return FALSE;
 }
 
 static void
-upload_one_primary_region(qxl_screen_t *qxl, PixmapPtr pixmap, BoxPtr b)
+upload_video_frame (qxl_screen_t *qxl, PixmapPtr pixmap)
 {
-    struct QXLRect rect;
-    struct qxl_bo *drawable_bo, *image_bo;
-    struct QXLDrawable *drawable;
-    FbBits *data;
-    int stride;
-    int bpp;
-
-    if (b->x1 >= qxl->virtual_x || b->y1 >= qxl->virtual_y)
-        return;
+    BoxRec box = qxl->video.box;
+    uint64_t id;
 
-    rect.left = b->x1;
-    rect.right = min(b->x2, qxl->virtual_x);
-    rect.top = b->y1;
-    rect.bottom = min(b->y2, qxl->virtual_y);
+    box.x2 = min (box.x2, qxl->virtual_x);
+    box.y2 = min (box.y2, qxl->virtual_y);
+    if (box.x1 >= box.x2 || box.y1 >= box.y2)
+	return;
 
-    drawable_bo = make_drawable (qxl, qxl->primary, QXL_DRAW_COPY, &rect);
-    drawable = qxl->bo_funcs->bo_map(drawable_bo);
-    drawable->u.copy.src_area = rect;
-    translate_rect (&drawable->u.copy.src_area);
-    drawable->u.copy.rop_descriptor = ROPD_OP_PUT;
-    drawable->u.copy.scale_mode = 0;
-    drawable->u.copy.mask.flags = 0;
-    drawable->u.copy.mask.pos.x = 0;
-    drawable->u.copy.mask.pos.y = 0;
-    drawable->u.copy.mask.bitmap = 0;
-    qxl->bo_funcs->bo_unmap(drawable_bo);
+    /* Frame ids are never zero */
+    id = ((uint64_t)qxl->video.id << 32) | ++qxl->video.frame;
 
-    fbGetPixmapBitsData(pixmap, data, stride, bpp);
-    image_bo = qxl_image_create (
-	qxl, (const uint8_t *)data, rect.left, rect.top, rect.right - rect.left, rect.bottom - rect.top, stride * sizeof(*data),
-	bpp == 24 ? 4 : bpp / 8, TRUE);
-    qxl->bo_funcs->bo_output_bo_reloc(qxl, offsetof(QXLDrawable, u.copy.src_bitmap),
-				   drawable_bo, image_bo);
+    upload_one_primary_region (qxl, pixmap, &box, id);
 
-    push_drawable (qxl, drawable_bo);
-    qxl->bo_funcs->bo_decref(qxl, image_bo);
+    if (qxl->scroll_hashes)
+	update_scroll_hashes (qxl, &box, NULL, 0, 0);
 }
 
 void
@@ -334,15 +1181,44 @@ qxl_surface_upload_primary_regions(qxl_screen_t *qxl, PixmapPtr pixmap, RegionRe
 {
     int n_boxes;
     BoxPtr boxes;
+    RegionRec rest;
+
+    if (!qxl->scroll_hashes)
+    {
+	qxl->scroll_bands =
+	    (qxl->virtual_x + SCROLL_BAND_WIDTH - 1) / SCROLL_BAND_WIDTH;
+	qxl->scroll_height = qxl->virtual_y;
+	qxl->scroll_hashes =
+	    calloc (qxl->scroll_bands * qxl->scroll_height, 2 * sizeof (uint64_t));
+    }
+
+    RegionNull(&rest);
+    RegionCopy(&rest, r);
 
-    n_boxes = RegionNumRects(r);
-    boxes = RegionRects(r);
+    if (qxl->detect_video && track_video (qxl, r))
+    {
+	RegionRec video;
+
+	upload_video_frame (qxl, pixmap);
+
+	RegionInit(&video, &qxl->video.box, 1);
+	RegionSubtract(&rest, &rest, &video);
+	RegionUninit(&video);
+    }
+
+    n_boxes = RegionNumRects(&rest);
+    boxes = RegionRects(&rest);
 
     while (n_boxes--)
     {
-        upload_one_primary_region(qxl, pixmap, boxes);
+	if (qxl->scroll_hashes)
+	    upload_primary_box(qxl, pixmap, boxes);
+	else
+	    upload_one_primary_region(qxl, pixmap, boxes, 0);
         boxes++;
     }
+
+    RegionUninit(&rest);
 }
 
 void
@@ -353,12 +1229,22 @@ qxl_surface_finish_access (qxl_surface_t *surface, PixmapPtr pixmap)
     int h = pixmap->drawable.height;
     int n_boxes;
     BoxPtr boxes;
-
-    n_boxes = REGION_NUM_RECTS (&surface->access_region);
-    boxes = REGION_RECTS (&surface->access_region);
+    RegionRec written;
 
     if (surface->access_type == UXA_ACCESS_RW)
     {
+	/* Only upload what the fallback may have written */
+	REGION_INIT (NULL, &written, (BoxPtr)NULL, 0);
+	REGION_COPY (NULL, &written, &surface->write_region);
+
+	if (surface->tile_hashes)
+	    for_each_tile (surface, add_changed_tile, &written);
+
+	REGION_INTERSECT (NULL, &written, &written, &surface->access_region);
+
+	n_boxes = REGION_NUM_RECTS (&written);
+	boxes = REGION_RECTS (&written);
+
 	if (n_boxes < 25)
 	{
 	    while (n_boxes--)
@@ -371,20 +1257,90 @@ qxl_surface_finish_access (qxl_surface_t *surface, PixmapPtr pixmap)
 	else
 	{
 	    qxl_upload_box (surface,
-			surface->access_region.extents.x1,
-			surface->access_region.extents.y1,
-			surface->access_region.extents.x2,
-			surface->access_region.extents.y2);
+			written.extents.x1,
+			written.extents.y1,
+			written.extents.x2,
+			written.extents.y2);
 	}
+
+	mark_uploaded (surface, &written,
+		       (const uint8_t *)pixman_image_get_data (surface->host_image),
+		       pixman_image_get_stride (surface->host_image), 0, 0);
+
+	REGION_UNINIT (NULL, &written);
     }
 
+    free (surface->tile_hashes);
+    surface->tile_hashes = NULL;
+
+    REGION_EMPTY (pScreen, &surface->write_region);
     REGION_EMPTY (pScreen, &surface->access_region);
     surface->access_type = UXA_ACCESS_RO;
     
     pScreen->ModifyPixmapHeader(pixmap, w, h, -1, -1, 0, NULL);
+
+    release_idle_shadow (surface);
 }
 
 
+/* Takes the contents of the surface into host memory for good; the
+ * caller owns the returned image and must destroy the surface.
+ * Returns NULL if there is no memory for it.
+ */
+pixman_image_t *
+qxl_surface_evict (qxl_surface_t *surface)
+{
+    pixman_image_t *image;
+
+    if (!ensure_host_image (surface))
+	return NULL;
+
+    qxl_surface_flush (surface);
+    qxl_download_box (surface, 0, 0,
+		      qxl_surface_width (surface), qxl_surface_height (surface));
+
+    image = surface->host_image;
+    surface->host_image = NULL;
+
+    return image;
+}
+
+/* The opposite of qxl_surface_evict(): puts @image on the device,
+ * consuming it.
+ */
+void
+qxl_surface_adopt (qxl_surface_t *surface, pixman_image_t *image)
+{
+    int w = min (pixman_image_get_width (image),
+		 qxl_surface_width (surface));
+    int h = min (pixman_image_get_height (image),
+		 qxl_surface_height (surface));
+
+    if (!surface->host_image						&&
+	pixman_image_get_width (image) == qxl_surface_width (surface)	&&
+	pixman_image_get_height (image) == qxl_surface_height (surface)	&&
+	pixman_image_get_format (image) == pixman_image_get_format (surface->dev_image))
+    {
+	/* It can serve as the host image as it is */
+	surface->host_image = image;
+    }
+    else
+    {
+	if (ensure_host_image (surface))
+	{
+	    pixman_image_composite (PIXMAN_OP_SRC,
+				    image, NULL, surface->host_image,
+				    0, 0, 0, 0, 0, 0, w, h);
+	}
+	pixman_image_unref (image);
+
+	if (!surface->host_image)
+	    return;
+    }
+
+    qxl_upload_box (surface, 0, 0, w, h);
+}
+
 #ifdef DEBUG_REGIONS
 static void
 print_region (const char *header, RegionPtr pRegion)
@@ -410,11 +1366,65 @@ print_region (const char *header, RegionPtr pRegion)
 }
 #endif // DEBUG_REGIONS
 
+/* pending */
+
+/* Upper bound on the number of clip rects sent with one drawable */
+#define MAX_PENDING_RECTS 256
+
+static void
+add_pending_box (qxl_surface_t *dest, int type,
+		 int src_dx, int src_dy, int mask_dx, int mask_dy,
+		 int x1, int y1, int x2, int y2)
+{
+    BoxRec box;
+    RegionRec r;
+
+    box.x1 = x1;
+    box.y1 = y1;
+    box.x2 = x2;
+    box.y2 = y2;
+
+    /* Boxes can only share a drawable when they use the same source
+     * offsets and don't overlap; overlapping boxes would otherwise be
+     * rendered once instead of twice.
+     */
+    if (dest->pending.type != QXL_DRAW_NOP		&&
+	(dest->pending.type != type			||
+	 dest->pending.src_dx != src_dx			||
+	 dest->pending.src_dy != src_dy			||
+	 dest->pending.mask_dx != mask_dx		||
+	 dest->pending.mask_dy != mask_dy		||
+	 REGION_NUM_RECTS (&dest->pending.region) >= MAX_PENDING_RECTS ||
+	 RECT_IN_REGION (NULL, &dest->pending.region, &box) != rgnOUT))
+    {
+	qxl_surface_flush (dest);
+    }
+
+    if (dest->pending.type == QXL_DRAW_NOP)
+    {
+	REGION_INIT (NULL, &dest->pending.region, &box, 1);
+
+	dest->pending.type = type;
+	dest->pending.src_dx = src_dx;
+	dest->pending.src_dy = src_dy;
+	dest->pending.mask_dx = mask_dx;
+	dest->pending.mask_dy = mask_dy;
+    }
+    else
+    {
+	REGION_INIT (NULL, &r, &box, 1);
+	REGION_UNION (NULL, &dest->pending.region, &dest->pending.region, &r);
+	REGION_UNINIT (NULL, &r);
+    }
+}
+
 /* solid */
 Bool
 qxl_surface_prepare_solid (qxl_surface_t *destination,
 			   Pixel	  fg)
 {
+    qxl_surface_flush (destination);
+
     if (!REGION_NIL (&(destination->access_region)))
     {
 	ErrorF (" solid not in vmem\n");
@@ -436,18 +1446,7 @@ qxl_surface_solid (qxl_surface_t *destination,
 		   int	          x2,
 		   int	          y2)
 {
-    qxl_screen_t *qxl = destination->qxl;
-    struct QXLRect qrect;
-    uint32_t p;
-
-    qrect.top = y1;
-    qrect.bottom = y2;
-    qrect.left = x1;
-    qrect.right = x2;
-
-    p = destination->u.solid_pixel;
-    
-    submit_fill (qxl, destination, &qrect, p);
+    add_pending_box (destination, QXL_DRAW_FILL, 0, 0, 0, 0, x1, y1, x2, y2);
 }
 
 /* copy */
@@ -455,6 +1454,8 @@ Bool
 qxl_surface_prepare_copy (qxl_surface_t *dest,
 			  qxl_surface_t *source)
 {
+    qxl_surface_flush (dest);
+
     if (!REGION_NIL (&(dest->access_region))	||
 	!REGION_NIL (&(source->access_region)))
     {
@@ -493,34 +1494,80 @@ static struct qxl_bo *image_from_surface(qxl_screen_t *qxl, qxl_surface_t *dest)
     return dest->image_bo;
 }
 
-void
-qxl_surface_copy (qxl_surface_t *dest,
-		  int  src_x1, int src_y1,
-		  int  dest_x1, int dest_y1,
-		  int width, int height)
+static void
+copy_from_surface (qxl_surface_t *dest, qxl_surface_t *src,
+		   const struct QXLRect *qrect, RegionPtr clip,
+		   int dx, int dy)
+{
+    qxl_screen_t *qxl = dest->qxl;
+    struct qxl_bo *drawable_bo;
+    struct QXLDrawable *drawable;
+    struct qxl_bo *image_bo;
+    int src_x1 = qrect->left + dx;
+    int src_y1 = qrect->top + dy;
+    int width = qrect->right - qrect->left;
+    int height = qrect->bottom - qrect->top;
+
+    src->ref_count++;
+
+    image_bo = image_from_surface(qxl, src);
+
+    drawable_bo = make_drawable (qxl, dest, QXL_DRAW_COPY, qrect, clip);
+
+    drawable = qxl->bo_funcs->bo_map(drawable_bo);
+    qxl->bo_funcs->bo_output_bo_reloc(qxl, offsetof(QXLDrawable, u.copy.src_bitmap),
+				   drawable_bo, image_bo);
+    drawable->u.copy.src_area.left = src_x1;
+    drawable->u.copy.src_area.top = src_y1;
+    drawable->u.copy.src_area.right = src_x1 + width;
+    drawable->u.copy.src_area.bottom = src_y1 + height;
+    drawable->u.copy.rop_descriptor = ROPD_OP_PUT;
+    drawable->u.copy.scale_mode = 0;
+    drawable->u.copy.mask.flags = 0;
+    drawable->u.copy.mask.pos.x = 0;
+    drawable->u.copy.mask.pos.y = 0;
+    drawable->u.copy.mask.bitmap = 0;
+
+    qxl->bo_funcs->bo_output_surf_reloc(qxl, offsetof(struct QXLDrawable, surfaces_dest[0]), drawable_bo, src);
+    drawable->surfaces_rects[0] = drawable->u.copy.src_area;
+
+    assert (src_x1 >= 0);
+    assert (src_y1 >= 0);
+
+    if (width > qxl_surface_width (src))
+    {
+	ErrorF ("dest w: %d   src w: %d\n",
+		width, qxl_surface_width (src));
+    }
+
+    assert (width <= qxl_surface_width (src));
+    assert (height <= qxl_surface_height (src));
+
+    qxl->bo_funcs->bo_unmap(drawable_bo);
+    push_drawable (qxl, drawable_bo);
+    qxl->bo_funcs->bo_decref(qxl, image_bo);
+}
+
+static void
+submit_copy (qxl_surface_t *dest, const struct QXLRect *qrect, RegionPtr clip,
+	     int dx, int dy)
 {
     qxl_screen_t *qxl = dest->qxl;
     struct qxl_bo *drawable_bo;
     struct QXLDrawable *drawable;
-    struct QXLRect qrect;
 
 #ifdef DEBUG_REGIONS
     print_region (" copy src", &(dest->u.copy_src->access_region));
     print_region (" copy dest", &(dest->access_region));
 #endif
 
-    qrect.top = dest_y1;
-    qrect.bottom = dest_y1 + height;
-    qrect.left = dest_x1;
-    qrect.right = dest_x1 + width;
-    
     if (dest->id == dest->u.copy_src->id)
     {
-	drawable_bo = make_drawable (qxl, dest, QXL_COPY_BITS, &qrect);
+	drawable_bo = make_drawable (qxl, dest, QXL_COPY_BITS, qrect, clip);
 
 	drawable = qxl->bo_funcs->bo_map(drawable_bo);
-	drawable->u.copy_bits.src_pos.x = src_x1;
-	drawable->u.copy_bits.src_pos.y = src_y1;
+	drawable->u.copy_bits.src_pos.x = qrect->left + dx;
+	drawable->u.copy_bits.src_pos.y = qrect->top + dy;
 	qxl->bo_funcs->bo_unmap(drawable_bo);
 
 	push_drawable (qxl, drawable_bo);
@@ -528,49 +1575,21 @@ qxl_surface_copy (qxl_surface_t *dest,
     }
     else
     {
-	struct qxl_bo *image_bo;
-
-	dest->u.copy_src->ref_count++;
-
-	image_bo = image_from_surface(qxl, dest->u.copy_src);
-
-	drawable_bo = make_drawable (qxl, dest, QXL_DRAW_COPY, &qrect);
-
-	drawable = qxl->bo_funcs->bo_map(drawable_bo);
-	qxl->bo_funcs->bo_output_bo_reloc(qxl, offsetof(QXLDrawable, u.copy.src_bitmap),
-				       drawable_bo, image_bo);
-	drawable->u.copy.src_area.left = src_x1;
-	drawable->u.copy.src_area.top = src_y1;
-	drawable->u.copy.src_area.right = src_x1 + width;
-	drawable->u.copy.src_area.bottom = src_y1 + height;
-	drawable->u.copy.rop_descriptor = ROPD_OP_PUT;
-	drawable->u.copy.scale_mode = 0;
-	drawable->u.copy.mask.flags = 0;
-	drawable->u.copy.mask.pos.x = 0;
-	drawable->u.copy.mask.pos.y = 0;
-	drawable->u.copy.mask.bitmap = 0;
-
-	qxl->bo_funcs->bo_output_surf_reloc(qxl, offsetof(struct QXLDrawable, surfaces_dest[0]), drawable_bo, dest->u.copy_src);
-	drawable->surfaces_rects[0] = drawable->u.copy.src_area;
- 	
-	assert (src_x1 >= 0);
-	assert (src_y1 >= 0);
-
-	if (width > pixman_image_get_width (dest->u.copy_src->host_image))
-	{
-	    ErrorF ("dest w: %d   src w: %d\n",
-		    width, pixman_image_get_width (dest->u.copy_src->host_image));
-	}
-	
-	assert (width <= pixman_image_get_width (dest->u.copy_src->host_image));
-	assert (height <= pixman_image_get_height (dest->u.copy_src->host_image));
-
-	qxl->bo_funcs->bo_unmap(drawable_bo);
-	push_drawable (qxl, drawable_bo);
-	qxl->bo_funcs->bo_decref(qxl, image_bo);
+	copy_from_surface (dest, dest->u.copy_src, qrect, clip, dx, dy);
     }
 }
 
+void
+qxl_surface_copy (qxl_surface_t *dest,
+		  int  src_x1, int src_y1,
+		  int  dest_x1, int dest_y1,
+		  int width, int height)
+{
+    add_pending_box (dest, QXL_DRAW_COPY,
+		     src_x1 - dest_x1, src_y1 - dest_y1, 0, 0,
+		     dest_x1, dest_y1, dest_x1 + width, dest_y1 + height);
+}
+
 /* composite */
 Bool
 qxl_surface_prepare_composite (int op,
@@ -581,6 +1600,8 @@ qxl_surface_prepare_composite (int op,
 			       qxl_surface_t *	mask,
 			       qxl_surface_t *	dest)
 {
+    qxl_surface_flush (dest);
+
     dest->u.composite.op = op;
     dest->u.composite.src_picture = src_picture;
     dest->u.composite.mask_picture = mask_picture;
@@ -634,8 +1655,8 @@ static QXLRect
 full_rect (qxl_surface_t *surface)
 {
     QXLRect r;
-    int w = pixman_image_get_width (surface->host_image);
-    int h = pixman_image_get_height (surface->host_image);
+    int w = qxl_surface_width (surface);
+    int h = qxl_surface_height (surface);
 	    
     r.left = r.top = 0;
     r.right = w;
@@ -644,12 +1665,40 @@ full_rect (qxl_surface_t *surface)
     return r;
 }
 
-void
-qxl_surface_composite (qxl_surface_t *dest,
-		       int src_x, int src_y,
-		       int mask_x, int mask_y,
-		       int dest_x, int dest_y,
-		       int width, int height)
+/* OVER (or SRC) with an opaque source that lies entirely inside its
+ * surface and isn't transformed is just a copy.
+ */
+static Bool
+composite_is_copy (qxl_surface_t *dest, const QXLRect *rect, int src_x, int src_y)
+{
+    PicturePtr src = dest->u.composite.src_picture;
+    PicturePtr dst = dest->u.composite.dest_picture;
+    qxl_surface_t *qsrc = dest->u.composite.src;
+    int op = dest->u.composite.op;
+
+    if (op != PictOpOver && op != PictOpSrc)
+	return FALSE;
+
+    if (dest->u.composite.mask_picture || !qsrc || qsrc == dest || !qsrc->opaque)
+	return FALSE;
+
+    if (src->transform || src->alphaMap || dst->alphaMap)
+	return FALSE;
+
+    if (src->format != dst->format &&
+	!(src->format == PICT_a8r8g8b8 && dst->format == PICT_x8r8g8b8))
+    {
+	return FALSE;
+    }
+
+    return (src_x >= 0 && src_y >= 0 &&
+	    src_x + (rect->right - rect->left) <= qxl_surface_width (qsrc) &&
+	    src_y + (rect->bottom - rect->top) <= qxl_surface_height (qsrc));
+}
+
+static void
+submit_composite (qxl_surface_t *dest, const QXLRect *rect, RegionPtr clip,
+		  int src_x, int src_y, int mask_x, int mask_y)
 {
     qxl_screen_t *qxl = dest->qxl;
     PicturePtr src = dest->u.composite.src_picture;
@@ -660,7 +1709,6 @@ qxl_surface_composite (qxl_surface_t *dest,
     struct QXLDrawable *drawable;
     struct qxl_bo *drawable_bo;
     QXLComposite *composite;
-    QXLRect rect;
     struct qxl_bo *trans_bo, *img_bo;
     int n_deps = 0;
     int force_opaque;
@@ -676,17 +1724,20 @@ qxl_surface_composite (qxl_surface_t *dest,
 	    dest->u.composite.src->id,
 	    dest->u.composite.mask? dest->u.composite.mask->id : -1,
 	    dest->u.composite.dest_picture->format,
-	    dest_x, dest_y, width, height,
+	    rect->left, rect->top,
+	    rect->right - rect->left, rect->bottom - rect->top,
 	    dest->id
 	);
 #endif
 
-    rect.left = dest_x;
-    rect.right = dest_x + width;
-    rect.top = dest_y;
-    rect.bottom = dest_y + height;
-    
-    drawable_bo = make_drawable (qxl, dest, QXL_DRAW_COMPOSITE, &rect);
+    if (composite_is_copy (dest, rect, src_x, src_y))
+    {
+	copy_from_surface (dest, qsrc, rect, clip,
+			   src_x - rect->left, src_y - rect->top);
+	return;
+    }
+
+    drawable_bo = make_drawable (qxl, dest, QXL_DRAW_COMPOSITE, rect, clip);
 
     drawable = qxl->bo_funcs->bo_map(drawable_bo);
 
@@ -700,7 +1751,7 @@ qxl_surface_composite (qxl_surface_t *dest,
     composite->flags |= (op & 0xff);
 
     img_bo = image_from_picture (qxl, src, qsrc, &force_opaque);
-    if (force_opaque)
+    if (force_opaque || qsrc->opaque)
 	composite->flags |= SPICE_COMPOSITE_SOURCE_OPAQUE;
     qxl->bo_funcs->bo_output_bo_reloc(qxl, offsetof(QXLDrawable, u.composite.src),
 				   drawable_bo, img_bo);
@@ -724,7 +1775,7 @@ qxl_surface_composite (qxl_surface_t *dest,
     if (mask)
     {
 	img_bo = image_from_picture (qxl, mask, qmask, &force_opaque);
-	if (force_opaque)
+	if (force_opaque || qmask->opaque)
 	    composite->flags |= SPICE_COMPOSITE_MASK_OPAQUE;
 
 	qxl->bo_funcs->bo_output_bo_reloc(qxl, offsetof(QXLDrawable, u.composite.mask),
@@ -770,6 +1821,79 @@ qxl_surface_composite (qxl_surface_t *dest,
       qxl->bo_funcs->bo_decref(qxl, derefs[i]);
 }
 
+void
+qxl_surface_composite (qxl_surface_t *dest,
+		       int src_x, int src_y,
+		       int mask_x, int mask_y,
+		       int dest_x, int dest_y,
+		       int width, int height)
+{
+    add_pending_box (dest, QXL_DRAW_COMPOSITE,
+		     src_x - dest_x, src_y - dest_y,
+		     mask_x - dest_x, mask_y - dest_y,
+		     dest_x, dest_y, dest_x + width, dest_y + height);
+}
+
+/* Send the boxes collected since the last prepare_* call as a single
+ * drawable covering their extents and clipped to their union.
+ */
+void
+qxl_surface_flush (qxl_surface_t *surface)
+{
+    BoxPtr extents;
+    QXLRect rect;
+    RegionPtr clip = &surface->pending.region;
+
+    if (surface->pending.type == QXL_DRAW_NOP)
+	return;
+
+    extents = REGION_EXTENTS (NULL, clip);
+    rect.left = extents->x1;
+    rect.top = extents->y1;
+    rect.right = extents->x2;
+    rect.bottom = extents->y2;
+
+    switch (surface->pending.type)
+    {
+    case QXL_DRAW_FILL:
+	submit_fill (surface->qxl, surface, &rect, clip, surface->u.solid_pixel);
+	mark_written (surface, clip,
+		      (surface->u.solid_pixel & 0xff000000) == 0xff000000);
+	break;
+
+    case QXL_DRAW_COPY:
+	submit_copy (surface, &rect, clip,
+		     surface->pending.src_dx, surface->pending.src_dy);
+	if (surface->u.copy_src != surface)
+	    mark_written (surface, clip, surface->u.copy_src->opaque);
+	break;
+
+    case QXL_DRAW_COMPOSITE:
+	submit_composite (surface, &rect, clip,
+			  rect.left + surface->pending.src_dx,
+			  rect.top + surface->pending.src_dy,
+			  rect.left + surface->pending.mask_dx,
+			  rect.top + surface->pending.mask_dy);
+
+	/* OVER keeps an opaque destination opaque */
+	if (composite_is_copy (surface, &rect,
+			       rect.left + surface->pending.src_dx,
+			       rect.top + surface->pending.src_dy))
+	{
+	    mark_written (surface, clip, TRUE);
+	}
+	else if (surface->u.composite.op != PictOpOver ||
+		 surface->u.composite.dest_picture->format != PICT_a8r8g8b8)
+	{
+	    mark_written (surface, clip, FALSE);
+	}
+	break;
+    }
+
+    REGION_UNINIT (NULL, clip);
+    surface->pending.type = QXL_DRAW_NOP;
+}
+
 Bool
 qxl_surface_put_image (qxl_surface_t *dest,
 		       int x, int y, int width, int height,
@@ -786,7 +1910,7 @@ qxl_surface_put_image (qxl_surface_t *dest,
     rect.top = y;
     rect.bottom = y + height;
 
-    drawable_bo = make_drawable (qxl, dest, QXL_DRAW_COPY, &rect);
+    drawable_bo = make_drawable (qxl, dest, QXL_DRAW_COPY, &rect, NULL);
 
     drawable = qxl->bo_funcs->bo_map(drawable_bo);
     drawable->u.copy.src_area.top = 0;
@@ -811,6 +1935,64 @@ qxl_surface_put_image (qxl_surface_t *dest,
     
     push_drawable (qxl, drawable_bo);
     qxl->bo_funcs->bo_decref(qxl, image_bo);    
+
+    if (dest->bpp == 32)
+    {
+	RegionRec region;
+	BoxRec box;
+
+	box.x1 = x;
+	box.y1 = y;
+	box.x2 = x + width;
+	box.y2 = y + height;
+
+	REGION_INIT (NULL, &region, &box, 1);
+	mark_uploaded (dest, &region, (const uint8_t *)src, src_pitch, x, y);
+	REGION_UNINIT (NULL, &region);
+    }
+
+    return TRUE;
+}
+
+/* Read straight from the device surface; this doesn't touch the
+ * host image, so nothing needs to be uploaded afterwards.
+ */
+Bool
+qxl_surface_get_image (qxl_surface_t *surface,
+		       int x, int y, int width, int height,
+		       char *dst, int dst_pitch)
+{
+    qxl_screen_t *qxl = surface->qxl;
+    uint8_t *src;
+    int src_stride;
+    int Bpp = surface->bpp == 24 ? 4 : surface->bpp / 8;
+
+    if (!qxl->pScrn->vtSema)
+	return FALSE;
+
+    qxl_surface_flush (surface);
+
+    /* The host image may have changes that the device doesn't */
+    if (!REGION_NIL (&surface->access_region))
+	return FALSE;
+
+    if (width <= 0 || height <= 0)
+	return TRUE;
+
+    qxl->bo_funcs->update_area (surface, x, y, x + width, y + height);
+
+    src = (uint8_t *)pixman_image_get_data (surface->dev_image);
+    src_stride = pixman_image_get_stride (surface->dev_image);
+
+    src += y * src_stride + x * Bpp;
+    while (height--)
+    {
+	memcpy (dst, src, width * Bpp);
+
+	dst += dst_pitch;
+	src += src_stride;
+    }
+
     return TRUE;
 }
 
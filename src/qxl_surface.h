@@ -11,10 +11,17 @@ struct qxl_surface_t
     uint32_t	        id;
 
     pixman_image_t *	dev_image;
-    pixman_image_t *	host_image;
+    pixman_image_t *	host_image;	/* allocated on first access,
+					 * except for the primary
+					 */
 
     uxa_access_t	access_type;
     RegionRec		access_region;
+    RegionRec		write_region;	/* damage of RW accesses */
+    uint64_t *		tile_hashes;	/* host image tiles before a RW
+					 * access that had no damage,
+					 * two words per tile
+					 */
 
     struct qxl_bo   *bo;
     struct qxl_surface_t *	next;
@@ -24,6 +31,15 @@ struct qxl_surface_t
 
     int			in_use;
     int			bpp;		/* bpp of the pixmap */
+    Bool		opaque;		/* all pixels of a 32 bpp surface
+					 * are known to have alpha 0xff
+					 */
+    int			n_fallbacks;	/* software fallbacks since the
+					 * last accelerated operation
+					 */
+    int			migrations;	/* times its pixmap moved between
+					 * host and device
+					 */
     int			ref_count;
 
     PixmapPtr		pixmap;
@@ -46,9 +62,34 @@ struct qxl_surface_t
 	    struct qxl_surface_t	*dest;
 	} composite;
     } u;
+
+    /* Boxes collected between prepare_* and done_*; they are sent
+     * as one drawable, clipped to the region, by qxl_surface_flush()
+     */
+    struct
+    {
+	int		type;		/* QXL_DRAW_NOP when nothing is pending */
+	RegionRec	region;
+	int		src_dx, src_dy;
+	int		mask_dx, mask_dy;
+    } pending;
+
     struct qxl_bo *image_bo;
 };
 
+/* The host image may not exist yet, so take the size from the device */
+static inline int
+qxl_surface_width (qxl_surface_t *surface)
+{
+    return pixman_image_get_width (surface->dev_image);
+}
+
+static inline int
+qxl_surface_height (qxl_surface_t *surface)
+{
+    return pixman_image_get_height (surface->dev_image);
+}
+
 void qxl_download_box (qxl_surface_t *surface, int x1, int y1, int x2, int y2);
 void qxl_upload_box (qxl_surface_t *surface, int x1, int y1, int x2, int y2);
 
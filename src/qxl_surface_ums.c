@@ -164,6 +164,9 @@ surface_cache_init (surface_cache_t *cache, qxl_screen_t *qxl)
 	
 	REGION_INIT (
 	    NULL, &(cache->all_surfaces[i].access_region), (BoxPtr)NULL, 0);
+	REGION_INIT (
+	    NULL, &(cache->all_surfaces[i].write_region), (BoxPtr)NULL, 0);
+	cache->all_surfaces[i].tile_hashes = NULL;
 	cache->all_surfaces[i].access_type = UXA_ACCESS_RO;
 
 	if (i) /* surface 0 is the primary surface */
@@ -249,8 +252,8 @@ surface_get_from_cache (surface_cache_t *cache, int width, int height, int bpp)
 
 	if (s && bpp == s->bpp)
 	{
-	    int w = pixman_image_get_width (s->host_image);
-	    int h = pixman_image_get_height (s->host_image);
+	    int w = qxl_surface_width (s);
+	    int h = qxl_surface_height (s);
 	    
 	    if (width <= w && width * 4 > w && height <= h && height * 4 > h)
 	    {
@@ -275,6 +278,7 @@ qxl_surface_recycle (surface_cache_t *cache, uint32_t id)
     if (surface->bo)
 	cache->qxl->bo_funcs->bo_decref (cache->qxl, surface->bo);
     surface->bo = NULL;
+    surface->in_use = FALSE;
     surface->next = cache->free_surfaces;
     cache->free_surfaces = surface;
 }
@@ -317,9 +321,8 @@ qxl_surface_cache_create_primary (qxl_screen_t *qxl,
     dev_image = pixman_image_create_bits (format, mode->x_res, mode->y_res,
 					  (uint32_t *)dev_addr, (qxl->kms_enabled ? mode->stride : -mode->stride));
 
-    host_image = pixman_image_create_bits (format, 
-					   qxl->virtual_x, qxl->virtual_y,
-					   NULL, mode->stride);
+    host_image = qxl_surface_create_shadow (qxl, format,
+					    qxl->virtual_x, qxl->virtual_y);
 #if 0
     xf86DrvMsg(cache->qxl->pScrn->scrnIndex, X_ERROR,
                "testing dev_image memory (%d x %d)\n",
@@ -337,13 +340,19 @@ qxl_surface_cache_create_primary (qxl_screen_t *qxl,
     surface->cache = cache;
     surface->qxl = qxl;
     surface->bpp = mode->bits;
+    surface->opaque = FALSE;
+    surface->n_fallbacks = 0;
+    surface->migrations = 0;
     surface->next = NULL;
     surface->prev = NULL;
     surface->evacuated = NULL;
     surface->bo = bo;
     surface->image_bo = NULL;
+    surface->pending.type = QXL_DRAW_NOP;
     
     REGION_INIT (NULL, &(surface->access_region), (BoxPtr)NULL, 0);
+    REGION_INIT (NULL, &(surface->write_region), (BoxPtr)NULL, 0);
+    surface->tile_hashes = NULL;
     surface->access_type = UXA_ACCESS_RO;
     
     return surface;
@@ -395,16 +404,26 @@ surface_get_from_free_list (surface_cache_t *cache)
 
     if (cache->free_surfaces)
     {
+#ifdef DEBUG_SURFACE_LIFECYCLE
 	qxl_surface_t *s;
+#endif
 
 	result = cache->free_surfaces;
 	cache->free_surfaces = cache->free_surfaces->next;
 
+	/* A surface that was put on the free list twice is still
+	 * marked in use the second time it comes off it.
+	 */
+	if (result->in_use)
+	    ErrorF ("huh: %d to be returned, but it is in use\n", result->id);
+	assert (!result->in_use);
+
 	result->next = NULL;
 	result->in_use = TRUE;
 	result->ref_count = 1;
 	result->pixmap = NULL;
 
+#ifdef DEBUG_SURFACE_LIFECYCLE
 	for (s = cache->free_surfaces; s; s = s->next)
 	{
 	    if (s->id == result->id)
@@ -413,6 +432,7 @@ surface_get_from_free_list (surface_cache_t *cache)
 
 	    assert (s->id != result->id);
 	}
+#endif
     }
     
     return result;
@@ -514,8 +534,7 @@ retry:
     surface->dev_image = pixman_image_create_bits (
 	pformat, width, height, dev_addr, - stride);
 
-    surface->host_image = pixman_image_create_bits (
-	pformat, width, height, NULL, -1);
+    surface->host_image = NULL;
 
     qxl->bo_funcs->bo_unmap(surface->bo);
     surface->bpp = bpp;
@@ -573,6 +592,10 @@ qxl_surface_create (qxl_screen_t *qxl,
 	if (!(surface = surface_send_create (cache, width, height, bpp)))
 	    return NULL;
 
+    surface->opaque = FALSE;
+    surface->n_fallbacks = 0;
+    surface->migrations = 0;
+
     surface->next = cache->live_surfaces;
     surface->prev = NULL;
     if (cache->live_surfaces)
@@ -621,6 +644,8 @@ surface_destroy (qxl_surface_t *surface)
 	pixman_image_unref (surface->dev_image);
     if (surface->host_image)
 	pixman_image_unref (surface->host_image);
+    surface->dev_image = NULL;
+    surface->host_image = NULL;
 
 #if 0
     ErrorF("destroy %ld\n", (long int)surface->end - (long int)surface->address);
@@ -742,9 +767,8 @@ qxl_surface_kill (qxl_surface_t *surface)
     }
 
     if (surface->id != 0					&&
-        surface->host_image                                     &&
-	pixman_image_get_width (surface->host_image) >= 128	&&
-	pixman_image_get_height (surface->host_image) >= 128)
+	qxl_surface_width (surface) >= 128			&&
+	qxl_surface_height (surface) >= 128)
     {
 	surface_add_to_cache (surface);
     }
@@ -776,8 +800,8 @@ qxl_surface_cache_evacuate_all (surface_cache_t *cache)
 	evacuated_surface_t *evacuated = malloc (sizeof (evacuated_surface_t));
 	int width, height;
 
-	width = pixman_image_get_width (s->host_image);
-	height = pixman_image_get_height (s->host_image);
+	width = qxl_surface_width (s);
+	height = qxl_surface_height (s);
 
 	qxl_download_box (s, 0, 0, width, height);
 
@@ -829,10 +853,10 @@ qxl_surface_cache_replace_all (surface_cache_t *cache, void *data)
 
 	surface = qxl_surface_create (cache->qxl, width, height, ev->bpp);
 
-	assert (surface->host_image);
 	assert (surface->dev_image);
 
-	pixman_image_unref (surface->host_image);
+	if (surface->host_image)
+	    pixman_image_unref (surface->host_image);
 	surface->host_image = ev->image;
 
 	qxl_upload_box (surface, 0, 0, width, height);
@@ -0,0 +1,397 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* A hierarchical timer wheel multiplexing all of the driver's timers
+ * on one X server timer. The X server keeps its timers on a sorted
+ * list, which gets slow with the number of timers spice-server creates
+ * per channel and with the frame and audio tickers re-arming every few
+ * milliseconds; here starting, cancelling and expiring a timer is O(1).
+ *
+ * The first level has a slot per millisecond for the next 256 ms; each
+ * further level has 64 slots, each as long as a whole lower level.
+ * When the first level wraps around, the next due slot of the level
+ * above is spread over the levels below it.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+
+/* Only the OS layer of the server, so the wheel can be tested on its own */
+#include <os.h>
+
+#include "qxl_timer.h"
+
+#define ROOT_BITS	8
+#define LEVEL_BITS	6
+#define N_LEVELS	4
+
+#define ROOT_SIZE	(1 << ROOT_BITS)
+#define LEVEL_SIZE	(1 << LEVEL_BITS)
+#define ROOT_MASK	(ROOT_SIZE - 1)
+#define LEVEL_MASK	(LEVEL_SIZE - 1)
+
+/* About 18 hours; longer timeouts are clamped */
+#define MAX_TIMEOUT	((1U << (ROOT_BITS + (N_LEVELS - 1) * LEVEL_BITS)) - 1)
+
+typedef struct slot_t slot_t;
+struct slot_t
+{
+    slot_t *		next;
+    slot_t *		prev;
+};
+
+struct qxl_timer_t
+{
+    slot_t		link;		/* first, so links cast back */
+    CARD32		expires;
+    int			level;		/* -1 when not pending */
+    qxl_timer_func_t	func;
+    void *		opaque;
+};
+
+static struct
+{
+    Bool		initialized;
+    OsTimerPtr		xorg_timer;
+    Bool		dispatching;
+    Bool		armed;
+    CARD32		armed_at;
+    CARD32		now;		/* next millisecond to expire */
+    int			n_pending;
+    int			n_level[N_LEVELS];
+    slot_t		root[ROOT_SIZE];
+    slot_t		levels[N_LEVELS - 1][LEVEL_SIZE];
+} wheel;
+
+static void
+slot_init (slot_t *slot)
+{
+    slot->next = slot->prev = slot;
+}
+
+static Bool
+slot_is_empty (slot_t *slot)
+{
+    return slot->next == slot;
+}
+
+static void
+slot_append (slot_t *slot, slot_t *link)
+{
+    link->prev = slot->prev;
+    link->next = slot;
+    slot->prev->next = link;
+    slot->prev = link;
+}
+
+static void
+slot_unlink (slot_t *link)
+{
+    link->prev->next = link->next;
+    link->next->prev = link->prev;
+    link->next = link->prev = link;
+}
+
+/* Moves all timers of a slot to an empty list head */
+static void
+slot_take (slot_t *slot, slot_t *list)
+{
+    slot_init (list);
+
+    if (slot_is_empty (slot))
+	return;
+
+    list->next = slot->next;
+    list->prev = slot->prev;
+    list->next->prev = list;
+    list->prev->next = list;
+    slot_init (slot);
+}
+
+static void
+init_wheel (void)
+{
+    int i, j;
+
+    for (i = 0; i < ROOT_SIZE; ++i)
+	slot_init (&wheel.root[i]);
+
+    for (i = 0; i < N_LEVELS - 1; ++i)
+    {
+	for (j = 0; j < LEVEL_SIZE; ++j)
+	    slot_init (&wheel.levels[i][j]);
+    }
+
+    wheel.now = GetTimeInMillis ();
+    wheel.initialized = TRUE;
+}
+
+static void
+insert (qxl_timer_t *timer)
+{
+    CARD32 delta;
+    int level;
+
+    if ((int32_t)(timer->expires - wheel.now) < 0)
+	timer->expires = wheel.now;
+
+    delta = timer->expires - wheel.now;
+    if (delta > MAX_TIMEOUT)
+    {
+	delta = MAX_TIMEOUT;
+	timer->expires = wheel.now + MAX_TIMEOUT;
+    }
+
+    if (delta < ROOT_SIZE)
+    {
+	slot_append (&wheel.root[timer->expires & ROOT_MASK], &timer->link);
+	level = 0;
+    }
+    else
+    {
+	for (level = 1; level < N_LEVELS - 1; ++level)
+	{
+	    if (delta < (1U << (ROOT_BITS + level * LEVEL_BITS)))
+		break;
+	}
+
+	slot_append (&wheel.levels[level - 1][
+			 (timer->expires >> (ROOT_BITS + (level - 1) * LEVEL_BITS)) & LEVEL_MASK],
+		     &timer->link);
+    }
+
+    timer->level = level;
+    wheel.n_level[level]++;
+}
+
+static void
+unlink_timer (qxl_timer_t *timer)
+{
+    slot_unlink (&timer->link);
+    wheel.n_level[timer->level]--;
+    timer->level = -1;
+}
+
+/* Called whenever the root level wraps around */
+static void
+cascade (void)
+{
+    int level;
+
+    for (level = 1; level < N_LEVELS; ++level)
+    {
+	int idx = (wheel.now >> (ROOT_BITS + (level - 1) * LEVEL_BITS)) & LEVEL_MASK;
+	slot_t list;
+
+	slot_take (&wheel.levels[level - 1][idx], &list);
+
+	while (!slot_is_empty (&list))
+	{
+	    qxl_timer_t *timer = (qxl_timer_t *)list.next;
+
+	    unlink_timer (timer);
+	    insert (timer);
+	}
+
+	if (idx != 0)
+	    break;
+    }
+}
+
+static void
+advance (CARD32 now)
+{
+    while ((int32_t)(now - wheel.now) >= 0)
+    {
+	int idx = wheel.now & ROOT_MASK;
+	slot_t expired;
+
+	if (idx == 0)
+	    cascade ();
+
+	if (wheel.n_level[0] == 0)
+	{
+	    /* Nothing in the root level, skip to where it wraps around */
+	    CARD32 wrap = (wheel.now | ROOT_MASK) + 1;
+
+	    if (wheel.n_pending == 0 || (int32_t)(wrap - now) > 0)
+	    {
+		wheel.now = now + 1;
+		break;
+	    }
+
+	    wheel.now = wrap;
+	    continue;
+	}
+
+	slot_take (&wheel.root[idx], &expired);
+	wheel.now++;
+
+	/* The callbacks are free to start, cancel or remove any timer,
+	 * including the ones still waiting on this list.
+	 */
+	while (!slot_is_empty (&expired))
+	{
+	    qxl_timer_t *timer = (qxl_timer_t *)expired.next;
+
+	    unlink_timer (timer);
+	    wheel.n_pending--;
+
+	    timer->func (timer->opaque);
+	}
+    }
+}
+
+static CARD32
+next_expiry (void)
+{
+    int i;
+
+    /* Stopped right where the root level wraps around; the cascade may
+     * bring in timers due before anything on the root level */
+    if ((wheel.now & ROOT_MASK) == 0)
+	return wheel.now;
+
+    if (wheel.n_level[0])
+    {
+	for (i = 0; i < ROOT_SIZE; ++i)
+	{
+	    if (!slot_is_empty (&wheel.root[(wheel.now + i) & ROOT_MASK]))
+		return wheel.now + i;
+	}
+    }
+
+    /* The next cascade */
+    return (wheel.now | ROOT_MASK) + 1;
+}
+
+static CARD32
+delay_until (CARD32 when, CARD32 now)
+{
+    int32_t delay = when - now;
+
+    /* 0 would disarm the X timer */
+    return delay > 0 ? delay : 1;
+}
+
+static CARD32
+wheel_callback (OsTimerPtr xorg_timer, CARD32 time, void *arg)
+{
+    wheel.armed = FALSE;
+
+    wheel.dispatching = TRUE;
+    advance (time);
+    wheel.dispatching = FALSE;
+
+    if (wheel.n_pending == 0)
+	return 0;
+
+    wheel.armed = TRUE;
+    wheel.armed_at = next_expiry ();
+
+    /* Non-zero makes the X server set the timer again */
+    return delay_until (wheel.armed_at, GetTimeInMillis ());
+}
+
+qxl_timer_t *
+qxl_timer_add (qxl_timer_func_t func, void *opaque)
+{
+    qxl_timer_t *timer = calloc (1, sizeof *timer);
+
+    if (!timer)
+	return NULL;
+
+    if (!wheel.initialized)
+	init_wheel ();
+
+    slot_init (&timer->link);
+    timer->level = -1;
+    timer->func = func;
+    timer->opaque = opaque;
+
+    return timer;
+}
+
+void
+qxl_timer_start (qxl_timer_t *timer, uint32_t ms)
+{
+    CARD32 now = GetTimeInMillis ();
+
+    qxl_timer_cancel (timer);
+
+    /* Nothing is waiting for the wheel to catch up */
+    if (wheel.n_pending == 0 && !wheel.dispatching)
+	wheel.now = now;
+
+    timer->expires = now + min (ms, MAX_TIMEOUT);
+    insert (timer);
+    wheel.n_pending++;
+
+    /* The callback arms the X timer itself once it is done */
+    if (wheel.dispatching)
+	return;
+
+    if (!wheel.armed || (int32_t)(timer->expires - wheel.armed_at) < 0)
+    {
+	wheel.armed = TRUE;
+	wheel.armed_at = timer->expires;
+	wheel.xorg_timer = TimerSet (wheel.xorg_timer, 0,
+				     delay_until (timer->expires, now),
+				     wheel_callback, NULL);
+    }
+}
+
+/* The X timer is left alone; waking up for nothing is cheaper than
+ * finding the next timer here.
+ */
+void
+qxl_timer_cancel (qxl_timer_t *timer)
+{
+    if (timer->level < 0)
+	return;
+
+    unlink_timer (timer);
+    wheel.n_pending--;
+}
+
+void
+qxl_timer_remove (qxl_timer_t *timer)
+{
+    qxl_timer_cancel (timer);
+    free (timer);
+}
+
+/* Called when the screen closes. The X server frees all its timers when
+ * it resets, so ours has to go now and be set up again by the next
+ * qxl_timer_start(). Timers still pending belong to spice-server, which
+ * outlives the screen in Xspice; they fire once the wheel runs again.
+ */
+void
+qxl_timer_fini (void)
+{
+    if (wheel.xorg_timer)
+	TimerFree (wheel.xorg_timer);
+
+    wheel.xorg_timer = NULL;
+    wheel.armed = FALSE;
+}
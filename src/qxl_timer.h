@@ -0,0 +1,36 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef QXL_TIMER_H
+#define QXL_TIMER_H
+
+#include <stdint.h>
+
+/* One-shot millisecond timers, all driven by a single X server timer */
+typedef struct qxl_timer_t qxl_timer_t;
+typedef void (*qxl_timer_func_t)(void *opaque);
+
+qxl_timer_t *	qxl_timer_add    (qxl_timer_func_t func, void *opaque);
+void		qxl_timer_start  (qxl_timer_t *timer, uint32_t ms);
+void		qxl_timer_cancel (qxl_timer_t *timer);
+void		qxl_timer_remove (qxl_timer_t *timer);
+void		qxl_timer_fini   (void);
+
+#endif /* QXL_TIMER_H */
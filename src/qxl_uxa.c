@@ -34,6 +34,7 @@
 #endif
 
 #include "qxl.h"
+#include "qxl_surface.h"
 #include "dfps.h"
 #include <spice/protocol.h>
 
@@ -43,11 +44,288 @@ DevPrivateKeyRec uxa_pixmap_index;
 int uxa_pixmap_index;
 #endif
 
+/*
+ * Placement
+ *
+ * Pixmaps go into device memory unless they are tiny, or pixmaps of
+ * about the same size have lately been falling back to software mostly.
+ * A device pixmap that keeps falling back is moved to host memory, and
+ * a host pixmap that keeps being offered to the accelerated paths is
+ * moved back. Every move of a pixmap doubles what it takes to move it
+ * again, so one with mixed use settles instead of bouncing.
+ */
+#define PLACEMENT_MIN_AREA	(16 * 16)	/* smaller ones stay on the host */
+#define PLACEMENT_MIN_SAMPLES	64	/* before the history is trusted */
+#define PLACEMENT_MAX_SAMPLES	4096	/* the history is halved beyond this */
+#define PLACEMENT_PROBE		16	/* one in this many goes to the device anyway */
+#define MIGRATE_FALLBACKS	32
+#define MIGRATE_ATTEMPTS	8
+#define MIGRATE_MAX_BACKOFF	6	/* doublings of the above */
+
+typedef struct
+{
+    pixman_image_t *	image;
+    int			attempts;	/* accelerated operations it was offered to */
+    int			migrations;	/* times the pixmap moved */
+} host_pixmap_t;
+
+#if HAS_DEVPRIVATEKEYREC
+static DevPrivateKeyRec host_pixmap_index;
+#else
+static int host_pixmap_index;
+#endif
+
+static host_pixmap_t *
+get_host_pixmap (PixmapPtr pixmap)
+{
+#if HAS_DEVPRIVATEKEYREC
+    return dixGetPrivate(&pixmap->devPrivates, &host_pixmap_index);
+#else
+    return dixLookupPrivate(&pixmap->devPrivates, &host_pixmap_index);
+#endif
+}
+
+static void
+set_host_pixmap (PixmapPtr pixmap, host_pixmap_t *host)
+{
+    dixSetPrivate(&pixmap->devPrivates, &host_pixmap_index, host);
+}
+
+static qxl_screen_t *
+pixmap_qxl (PixmapPtr pixmap)
+{
+    return xf86ScreenToScrn (pixmap->drawable.pScreen)->driverPrivate;
+}
+
+static int
+placement_class (int w, int h)
+{
+    int size = max (w, h);
+    int class = 0;
+
+    while (size > 16 && class < N_PLACEMENT_CLASSES - 1)
+    {
+	size >>= 1;
+	class++;
+    }
+
+    return class;
+}
+
+static void
+note_usage (PixmapPtr pixmap, Bool accelerated)
+{
+    qxl_screen_t *qxl = pixmap_qxl (pixmap);
+    qxl_surface_t *surface = get_surface (pixmap);
+    int c;
+
+    if (!surface || surface == qxl->primary)
+	return;
+
+    c = placement_class (pixmap->drawable.width, pixmap->drawable.height);
+
+    if (accelerated)
+    {
+	qxl->placement[c].accelerated++;
+	surface->n_fallbacks = 0;
+    }
+    else
+    {
+	qxl->placement[c].fallbacks++;
+	surface->n_fallbacks++;
+    }
+
+    if (qxl->placement[c].accelerated + qxl->placement[c].fallbacks > PLACEMENT_MAX_SAMPLES)
+    {
+	qxl->placement[c].accelerated /= 2;
+	qxl->placement[c].fallbacks /= 2;
+    }
+}
+
+/* A fallback UXA is about to take, because a check hook said no */
+static void
+note_fallback (DrawablePtr drawable)
+{
+    if (drawable && drawable->type == DRAWABLE_PIXMAP)
+	note_usage ((PixmapPtr)drawable, FALSE);
+}
+
+static int
+migrate_threshold (int base, int migrations)
+{
+    return base << min (migrations, MIGRATE_MAX_BACKOFF);
+}
+
+static Bool
+prefer_host (qxl_screen_t *qxl, int w, int h, unsigned usage)
+{
+    int c;
+
+    /* Window backing pixmaps are what the screen is made of */
+    if (usage == CREATE_PIXMAP_USAGE_BACKING_PIXMAP)
+	return FALSE;
+
+    /* Not worth a surface id */
+    if (w * h < PLACEMENT_MIN_AREA)
+	return TRUE;
+
+    c = placement_class (w, h);
+
+    if (qxl->placement[c].accelerated + qxl->placement[c].fallbacks < PLACEMENT_MIN_SAMPLES)
+	return FALSE;
+
+    if (qxl->placement[c].fallbacks <= 4 * qxl->placement[c].accelerated)
+	return FALSE;
+
+    /* Keep finding out how this class does on the device */
+    if (++qxl->placement[c].probe % PLACEMENT_PROBE == 0)
+	return FALSE;
+
+    return TRUE;
+}
+
+/* A pixmap in host memory that can later be moved to the device */
+static PixmapPtr
+create_host_pixmap (ScreenPtr screen, int w, int h, int depth, unsigned usage)
+{
+    SpiceSurfaceFmt format;
+    pixman_format_code_t pformat;
+    host_pixmap_t *host;
+    PixmapPtr pixmap;
+
+    qxl_get_formats (depth, &format, &pformat);
+    if (pformat == (pixman_format_code_t)-1)
+	return NULL;
+
+    if (!(host = malloc (sizeof *host)))
+	return NULL;
+
+    host->attempts = 0;
+    host->migrations = 0;
+    host->image = pixman_image_create_bits (pformat, w, h, NULL, -1);
+    if (!host->image)
+    {
+	free (host);
+	return NULL;
+    }
+
+    pixmap = fbCreatePixmap (screen, 0, 0, depth, usage);
+    if (!pixmap)
+    {
+	pixman_image_unref (host->image);
+	free (host);
+	return NULL;
+    }
+
+    screen->ModifyPixmapHeader (pixmap, w, h, -1, -1,
+				pixman_image_get_stride (host->image),
+				pixman_image_get_data (host->image));
+    set_host_pixmap (pixmap, host);
+
+    return pixmap;
+}
+
+static Bool
+migrate_to_host (qxl_screen_t *qxl, PixmapPtr pixmap, qxl_surface_t *surface)
+{
+    ScreenPtr screen = pixmap->drawable.pScreen;
+    host_pixmap_t *host;
+
+    if (!(host = malloc (sizeof *host)))
+	return FALSE;
+
+    host->attempts = 0;
+    host->migrations = surface->migrations + 1;
+    if (!(host->image = qxl_surface_evict (surface)))
+    {
+	free (host);
+	return FALSE;
+    }
+
+    qxl->bo_funcs->destroy_surface (surface);
+    set_surface (pixmap, NULL);
+    set_host_pixmap (pixmap, host);
+
+    screen->ModifyPixmapHeader (pixmap,
+				pixmap->drawable.width, pixmap->drawable.height,
+				-1, -1,
+				pixman_image_get_stride (host->image),
+				pixman_image_get_data (host->image));
+
+    qxl->moved_to_host++;
+    return TRUE;
+}
+
+static Bool
+migrate_to_device (qxl_screen_t *qxl, PixmapPtr pixmap, host_pixmap_t *host)
+{
+    ScreenPtr screen = pixmap->drawable.pScreen;
+    qxl_surface_t *surface;
+
+    surface = qxl->bo_funcs->create_surface (
+	qxl, pixmap->drawable.width, pixmap->drawable.height, pixmap->drawable.depth);
+    if (!surface)
+	return FALSE;
+
+    qxl_surface_adopt (surface, host->image);
+    surface->migrations = host->migrations + 1;
+    set_host_pixmap (pixmap, NULL);
+    free (host);
+
+    set_surface (pixmap, surface);
+    qxl_surface_set_pixmap (surface, pixmap);
+
+    screen->ModifyPixmapHeader (pixmap,
+				pixmap->drawable.width, pixmap->drawable.height,
+				-1, -1, 0, NULL);
+
+    qxl->moved_to_device++;
+    return TRUE;
+}
+
+/* Called from the check hooks, before UXA looks at where the pixmap is */
+static void
+offer_to_device (DrawablePtr drawable)
+{
+    PixmapPtr pixmap;
+    host_pixmap_t *host;
+
+    if (!drawable || drawable->type != DRAWABLE_PIXMAP)
+	return;
+
+    pixmap = (PixmapPtr)drawable;
+    if (pixmap->drawable.width * pixmap->drawable.height < PLACEMENT_MIN_AREA)
+	return;
+
+    host = get_host_pixmap (pixmap);
+    if (host &&
+	++host->attempts >= migrate_threshold (MIGRATE_ATTEMPTS, host->migrations))
+    {
+	if (uxa_swapped_out (pixmap->drawable.pScreen) ||
+	    !migrate_to_device (pixmap_qxl (pixmap), pixmap, host))
+	{
+	    host->attempts = 0;
+	}
+    }
+}
+
 static Bool
 qxl_prepare_access (PixmapPtr pixmap, RegionPtr region, uxa_access_t access)
 {
-    return qxl_surface_prepare_access (get_surface (pixmap),
-                                       pixmap, region, access);
+    qxl_surface_t *surface = get_surface (pixmap);
+    qxl_screen_t *qxl = pixmap_qxl (pixmap);
+
+    /* Once it's out of the device, UXA won't call finish_access */
+    if (surface->n_fallbacks >=
+	    migrate_threshold (MIGRATE_FALLBACKS, surface->migrations) &&
+	qxl->pScrn->vtSema					&&
+	REGION_NIL (&surface->access_region)			&&
+	migrate_to_host (qxl, pixmap, surface))
+    {
+	return TRUE;
+    }
+
+    return qxl_surface_prepare_access (surface, pixmap, region, access);
 }
 
 static void
@@ -81,7 +359,12 @@ static Bool
 qxl_check_solid (DrawablePtr drawable, int alu, Pixel planemask)
 {
     if (!good_alu_and_pm (drawable, alu, planemask))
+    {
+	note_fallback (drawable);
 	return FALSE;
+    }
+
+    offer_to_device (drawable);
 
     return TRUE;
 }
@@ -94,7 +377,12 @@ qxl_prepare_solid (PixmapPtr pixmap, int alu, Pixel planemask, Pixel fg)
     if (!(surface = get_surface (pixmap)))
 	return FALSE;
 
-    return qxl_surface_prepare_solid (surface, fg);
+    if (!qxl_surface_prepare_solid (surface, fg))
+	return FALSE;
+
+    note_usage (pixmap, TRUE);
+
+    return TRUE;
 }
 
 static void
@@ -106,6 +394,7 @@ qxl_solid (PixmapPtr pixmap, int x1, int y1, int x2, int y2)
 static void
 qxl_done_solid (PixmapPtr pixmap)
 {
+    qxl_surface_flush (get_surface (pixmap));
 }
 
 /*
@@ -116,15 +405,24 @@ qxl_check_copy (PixmapPtr source, PixmapPtr dest,
                 int alu, Pixel planemask)
 {
     if (!good_alu_and_pm ((DrawablePtr)source, alu, planemask))
-	return FALSE;
+	goto fallback;
 
     if (source->drawable.bitsPerPixel != dest->drawable.bitsPerPixel)
     {
 	ErrorF ("differing bitsperpixel - this shouldn't happen\n");
-	return FALSE;
+	goto fallback;
     }
 
+    offer_to_device (&source->drawable);
+    offer_to_device (&dest->drawable);
+
     return TRUE;
+
+fallback:
+    note_fallback (&source->drawable);
+    note_fallback (&dest->drawable);
+
+    return FALSE;
 }
 
 static Bool
@@ -132,7 +430,14 @@ qxl_prepare_copy (PixmapPtr source, PixmapPtr dest,
                   int xdir, int ydir, int alu,
                   Pixel planemask)
 {
-    return qxl_surface_prepare_copy (get_surface (dest), get_surface (source));
+    if (!qxl_surface_prepare_copy (get_surface (dest), get_surface (source)))
+	return FALSE;
+
+    /* Only count operations that are actually accelerated */
+    note_usage (source, TRUE);
+    note_usage (dest, TRUE);
+
+    return TRUE;
 }
 
 static void
@@ -150,6 +455,7 @@ qxl_copy (PixmapPtr dest,
 static void
 qxl_done_copy (PixmapPtr dest)
 {
+    qxl_surface_flush (get_surface (dest));
 }
 
 /*
@@ -161,28 +467,34 @@ can_accelerate_picture (qxl_screen_t *qxl, PicturePtr pict)
     if (!pict)
 	return TRUE;
 
-    if (pict->format != PICT_a8r8g8b8		&&
-	pict->format != PICT_x8r8g8b8		&&
-	pict->format != PICT_a8)
+    if (!pict->pDrawable)
     {
+	/* Solid fills are turned into a 1x1 repeating surface by
+	 * uxa_acquire_solid(), which caches them by color.
+	 */
+	if (pict->pSourcePict->type == SourcePictTypeSolidFill)
+	    return TRUE;
+
         if (qxl->debug_render_fallbacks)
         {
-            ErrorF ("Image with format %x can't be accelerated \n",
-                    pict->format);
+            ErrorF ("Source image (of type %d) can't be accelerated\n",
+                    pict->pSourcePict->type);
         }
 
-        return FALSE;
+	return FALSE;
     }
 
-    if (!pict->pDrawable)
+    if (pict->format != PICT_a8r8g8b8		&&
+	pict->format != PICT_x8r8g8b8		&&
+	pict->format != PICT_a8)
     {
         if (qxl->debug_render_fallbacks)
         {
-            ErrorF ("Source image (of type %d) can't be accelerated\n",
-                    pict->pSourcePict->type);
+            ErrorF ("Image with format %x can't be accelerated \n",
+                    pict->format);
         }
-     
-	return FALSE;
+
+        return FALSE;
     }
 
     if (pict->transform)
@@ -221,16 +533,15 @@ qxl_has_composite (qxl_screen_t *qxl)
 {
 #ifdef XF86DRM_MODE
     if (qxl->kms_enabled) {
-#if 0 /* KMS Composite support seems broken - needs better hw support */
+	/* The kernel reports the client's capabilities, as the ROM
+	 * does for UMS
+	 */
 	static Bool result, checked;
 	if (!checked) {
 	    result = qxl_kms_check_cap(qxl, SPICE_DISPLAY_CAP_COMPOSITE);
 	    checked = TRUE;
 	}
 	return result;
-#else
-	return FALSE;
-#endif
     }
 #endif
 #ifndef XSPICE
@@ -248,16 +559,12 @@ qxl_has_a8_surfaces (qxl_screen_t *qxl)
 {
 #ifdef XF86DRM_MODE
     if (qxl->kms_enabled) {
-#if 0 /* KMS Composite support seems broken - needs better hw support */
         static Bool result, checked;
 	if (!checked) {
             result = qxl_kms_check_cap(qxl, SPICE_DISPLAY_CAP_A8_SURFACE);
 	    checked = TRUE;
 	}
 	return result;
-#else
-	return FALSE;
-#endif
     }
 #endif
 #ifndef XSPICE
@@ -314,13 +621,13 @@ qxl_check_composite (int op,
     };
 
     if (!qxl_has_composite (qxl))
-	return FALSE;
+	goto fallback;
 
     if (!can_accelerate_picture (qxl, pSrcPicture)	||
 	!can_accelerate_picture (qxl, pMaskPicture)	||
 	!can_accelerate_picture (qxl, pDstPicture))
     {
-	return FALSE;
+	goto fallback;
     }
 
     for (i = 0; i < sizeof (accelerated_ops) / sizeof (accelerated_ops[0]); ++i)
@@ -332,9 +639,20 @@ qxl_check_composite (int op,
     if (qxl->debug_render_fallbacks)
         ErrorF ("Compositing operator %d can't be accelerated\n", op);
 
+fallback:
+    note_fallback (pSrcPicture->pDrawable);
+    if (pMaskPicture)
+	note_fallback (pMaskPicture->pDrawable);
+    note_fallback (pDstPicture->pDrawable);
+
     return FALSE;
 
 found:
+    offer_to_device (pSrcPicture->pDrawable);
+    if (pMaskPicture)
+	offer_to_device (pMaskPicture->pDrawable);
+    offer_to_device (pDstPicture->pDrawable);
+
     return TRUE;
 }
 
@@ -348,6 +666,10 @@ static Bool
 qxl_check_composite_texture (ScreenPtr screen,
 			     PicturePtr pPicture)
 {
+    /* Make UXA replace source pictures with a real pixmap */
+    if (!pPicture->pDrawable)
+	return FALSE;
+
     return TRUE;
 }
 
@@ -360,11 +682,21 @@ qxl_prepare_composite (int op,
 		       PixmapPtr pMask,
 		       PixmapPtr pDst)
 {
-    return qxl_surface_prepare_composite (
-	op, pSrcPicture, pMaskPicture, pDstPicture,
-	get_surface (pSrc),
-	pMask? get_surface (pMask) : NULL,
-	get_surface (pDst));
+    if (!qxl_surface_prepare_composite (
+	    op, pSrcPicture, pMaskPicture, pDstPicture,
+	    get_surface (pSrc),
+	    pMask? get_surface (pMask) : NULL,
+	    get_surface (pDst)))
+    {
+	return FALSE;
+    }
+
+    note_usage (pSrc, TRUE);
+    if (pMask)
+	note_usage (pMask, TRUE);
+    note_usage (pDst, TRUE);
+
+    return TRUE;
 }
 
 static void
@@ -384,7 +716,7 @@ qxl_composite (PixmapPtr pDst,
 static void
 qxl_done_composite (PixmapPtr pDst)
 {
-    ;
+    qxl_surface_flush (get_surface (pDst));
 }
 
 static Bool
@@ -393,8 +725,24 @@ qxl_put_image (PixmapPtr pDst, int x, int y, int w, int h,
 {
     qxl_surface_t *surface = get_surface (pDst);
 
+    if (surface && qxl_surface_put_image (surface, x, y, w, h, src, src_pitch))
+    {
+	note_usage (pDst, TRUE);
+
+	return TRUE;
+    }
+
+    return FALSE;
+}
+
+static Bool
+qxl_get_image (PixmapPtr pSrc, int x, int y, int w, int h,
+               char *dst, int dst_pitch)
+{
+    qxl_surface_t *surface = get_surface (pSrc);
+
     if (surface)
-	return qxl_surface_put_image (surface, x, y, w, h, src, src_pitch);
+	return qxl_surface_get_image (surface, x, y, w, h, dst, dst_pitch);
 
     return FALSE;
 }
@@ -405,6 +753,8 @@ qxl_set_screen_pixmap (PixmapPtr pixmap)
     pixmap->drawable.pScreen->devPrivate = pixmap;
 }
 
+#define KMS_MIN_SURFACE_AREA (32 * 32)
+
 static PixmapPtr
 qxl_create_pixmap (ScreenPtr screen, int w, int h, int depth, unsigned usage)
 {
@@ -422,8 +772,18 @@ qxl_create_pixmap (ScreenPtr screen, int w, int h, int depth, unsigned usage)
     ErrorF ("Create pixmap: %d %d @ %d (usage: %d)\n", w, h, depth, usage);
 #endif
 
-    if (qxl->kms_enabled)
+    /* Without composite every RENDER operation on a device surface is
+     * a download, a software composite and an upload, so under KMS
+     * pixmaps only go to the device when the client can composite. The
+     * kernel allocates every surface separately; keep pixmaps that are
+     * too small to be worth it, and glyphs, in system memory.
+     */
+    if (qxl->kms_enabled &&
+	(!qxl_has_composite (qxl) ||
+	 w * h < KMS_MIN_SURFACE_AREA || usage == CREATE_PIXMAP_USAGE_GLYPH_PICTURE))
+    {
 	goto fallback;
+    }
     if (uxa_swapped_out (screen))
 	goto fallback;
 
@@ -439,9 +799,18 @@ qxl_create_pixmap (ScreenPtr screen, int w, int h, int depth, unsigned usage)
     if (!w || !h)
       goto fallback;
 
+    if (prefer_host (qxl, w, h, usage) &&
+	(pixmap = create_host_pixmap (screen, w, h, depth, usage)))
+    {
+	qxl->placed_on_host++;
+	return pixmap;
+    }
+
     surface = qxl->bo_funcs->create_surface (qxl, w, h, depth);
     if (surface)
     {
+	qxl->placed_on_device++;
+
 	/* ErrorF ("   Successfully created surface in video memory\n"); */
 
 	pixmap = fbCreatePixmap (screen, 0, 0, depth, usage);
@@ -500,6 +869,17 @@ qxl_destroy_pixmap (PixmapPtr pixmap)
 
 	    qxl_surface_cache_sanity_check (qxl->surface_cache);
 	}
+	else
+	{
+	    host_pixmap_t *host = get_host_pixmap (pixmap);
+
+	    if (host)
+	    {
+		pixman_image_unref (host->image);
+		free (host);
+		set_host_pixmap (pixmap, NULL);
+	    }
+	}
     }
 
     fbDestroyPixmap (pixmap);
@@ -532,6 +912,9 @@ set_uxa_functions(qxl_screen_t *qxl, ScreenPtr screen)
     /* PutImage */
     qxl->uxa->put_image = qxl_put_image;
 
+    /* GetImage */
+    qxl->uxa->get_image = qxl_get_image;
+
     /* Prepare access */
     qxl->uxa->prepare_access = qxl_prepare_access;
     qxl->uxa->finish_access = qxl_finish_access;
@@ -551,9 +934,13 @@ qxl_uxa_init (qxl_screen_t *qxl, ScreenPtr screen)
 #if HAS_DIXREGISTERPRIVATEKEY
     if (!dixRegisterPrivateKey (&uxa_pixmap_index, PRIVATE_PIXMAP, 0))
 	return FALSE;
+    if (!dixRegisterPrivateKey (&host_pixmap_index, PRIVATE_PIXMAP, 0))
+	return FALSE;
 #else
     if (!dixRequestPrivate (&uxa_pixmap_index, 0))
 	return FALSE;
+    if (!dixRequestPrivate (&host_pixmap_index, 0))
+	return FALSE;
 #endif
 
     qxl->uxa = uxa_driver_alloc ();
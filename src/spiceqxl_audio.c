@@ -24,16 +24,22 @@
    and mixes their raw data on to the spice playback channel.  */
 
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* memfd_create */
+#endif
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
 
 #include "spiceqxl_audio.h"
+#include "spiceqxl_audio_mix.h"
 
 #include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
-#include <sys/time.h>
+#include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 #include <dirent.h>
 #if defined(HAVE_SYS_INOTIFY_H)
@@ -43,13 +49,32 @@
 /* mplayer + pulse will write data to the fifo as fast as we can read it.
        So we need to pace both how quickly we consume the data and how quickly
        we feed the data in to Spice.  We will read ahead (up to READ_BUFFER_PERIODS),
-       and feed ahead into the Spice server (up to FEED_BUFFER_PERIODS).
+       and feed ahead into the Spice server (up to the configured latency).
 */
 
 #define IDLE_MS              300
-#define PERIOD_MS            10
 #define READ_BUFFER_PERIODS  2
-#define FEED_BUFFER_PERIODS  8
+
+/* spice-server picks the chunk size, not us: SND_CODEC_MAX_FRAME_SIZE
+   frames, whatever the rate.  Each ring must hold at least that much,
+   or a short period leaves mix_in_fifos() padding chunks with silence.  */
+#define SPICE_CHUNK_FRAMES   480
+
+/* The length of a period and how many are fed ahead come from the
+   SpicePlaybackPeriod and SpicePlaybackLatency options.  The feed-ahead
+   depth grows on underruns, up to twice the configured latency, and
+   shrinks again once a whole window of periods went by without coming
+   close to one.  */
+#define MIN_FEED_PERIODS     2
+#define FEED_WINDOW_PERIODS  1000
+
+/* Pacing is done on the monotonic clock.  spice-server derives mm_time
+   from that same clock and only ever shifts it for latency, so there is
+   no rate difference between the two to follow.  */
+#define NSEC_PER_MS          1000000ULL
+
+/* How often the bandwidth and encoding cost are logged, at verbosity 3 */
+#define REPORT_INTERVAL_S    60
 
 #define MAX_FIFOS 16
 
@@ -57,8 +82,10 @@ struct fifo_data {
     char *buffer;
     int   size;
     int   len;
-    int   add_to;
+    int   head;
+    int   mirrored;
     int   fd;
+    float gain;
     SpiceWatch *watch;
 };
 
@@ -67,9 +94,29 @@ struct audio_data {
     int active;
     uint32_t *spice_buffer;
     int spice_buffer_bytes;
+    /* Kept across periods for mixing several fifos */
+    float *mix_buffer;
+    int16_t *mix_scratch;
+    int mix_bytes;
     int period_bytes;
-    struct timeval fed_through_time;
-    int remainder;
+    int period_ms;
+    uint64_t fed_through;       /* monotonic ns the client has data up to */
+    uint64_t remainder;
+    uint64_t period_ns;
+    int feed_periods;
+    int max_feed_periods;
+    int window_periods;
+    uint64_t window_min_ahead;
+    /* statistics */
+    unsigned int underruns;
+    unsigned int feeds;
+    uint64_t latency_sum;
+    uint64_t latency_max;
+    uint64_t bytes_fed;
+    uint64_t encode_ns;         /* thread CPU spent handing samples over */
+    uint64_t report_start;
+    uint64_t report_bytes;
+    uint64_t report_encode_ns;
     int fifo_count;
     int closed_fifos;
     SpiceTimer *wall_timer;
@@ -79,78 +126,117 @@ struct audio_data {
     SpiceWatch *fifo_dir_qxl_watch;
 };
 
-/* We maintain a ring buffer for each file we are reading from;
-   these helper functions facilitate adding data to the buffer,
-   and removing it.  */
-static inline void fifo_data_added(struct fifo_data *f, int n)
+/* We maintain a ring buffer for each file we are reading from.  Where
+   possible its pages are mapped twice in a row, so that data running
+   off the end continues at the start and every read and copy is in
+   one piece.  Otherwise the data is moved back to the start of the
+   buffer before reading.  */
+static int fifo_alloc_buffer(struct fifo_data *f, int size)
 {
-    f->add_to = (f->add_to + n) % f->size;
-    f->len += n;
+#if defined(HAVE_MEMFD_CREATE)
+    long page = sysconf(_SC_PAGESIZE);
+    int mirror_size = (size + page - 1) / page * page;
+    char *base;
+    int fd;
+
+    fd = memfd_create("spiceqxl-playback", MFD_CLOEXEC);
+    if (fd >= 0 && ftruncate(fd, mirror_size) == 0) {
+        base = mmap(NULL, 2 * mirror_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base != MAP_FAILED) {
+            if (mmap(base, mirror_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED &&
+                mmap(base + mirror_size, mirror_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED) {
+                close(fd);
+                f->buffer = base;
+                f->size = mirror_size;
+                f->mirrored = 1;
+                return TRUE;
+            }
+            munmap(base, 2 * mirror_size);
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+#endif
+
+    f->buffer = calloc(1, size);
+    f->size = size;
+    f->mirrored = 0;
+    return f->buffer != NULL;
 }
 
 static inline int fifo_read(struct fifo_data *f)
 {
     int rc;
-    int len = min(f->size - f->len, f->size - f->add_to);
-    rc = read(f->fd, f->buffer + f->add_to, len);
-    if (rc > 0)
-        fifo_data_added(f, rc);
 
-    if (rc > 0 && rc == len && f->size - f->len > 0) {
-        rc = read(f->fd, f->buffer + f->add_to, f->size - f->len);
-        if (rc > 0)
-            fifo_data_added(f, rc);
+    if (!f->mirrored && f->head) {
+        memmove(f->buffer, f->buffer + f->head, f->len);
+        f->head = 0;
     }
 
+    rc = read(f->fd, f->buffer + (f->head + f->len) % f->size, f->size - f->len);
+    if (rc > 0)
+        f->len += rc;
+
     return rc;
 }
 
 static inline void fifo_remove_data(struct fifo_data *f, unsigned char *dest, int len)
 {
-    int remove_from = f->add_to >= f->len ? f->add_to - f->len : f->add_to + f->size - f->len;
-    int remain = f->size - remove_from;
-
-    if (remain < len) {
-        if (dest) {
-            memcpy(dest, f->buffer + remove_from, remain);
-            dest += remain;
-        }
-        len -= remain;
-        f->len -= remain;
-        remove_from = 0;
-    }
-
     if (dest) {
-        memcpy(dest, f->buffer + remove_from, len);
+        memcpy(dest, f->buffer + f->head, len);
     }
+    f->head = (f->head + len) % f->size;
     f->len -= len;
 }
 
-static void mix_in_one_fifo(struct fifo_data *f, int16_t *out, int len)
+/* A fifo named like "name@50" is mixed in at 50% volume */
+static float fifo_name_gain(const char *name)
 {
-    int s;
-    int16_t *in;
+    const char *at = strrchr(name, '@');
+    char *end;
+    long percent;
 
-    if (len > f->len)
-        len = f->len;
+    if (!at)
+        return 1.0f;
 
-    in = calloc(1, len);
+    percent = strtol(at + 1, &end, 10);
+    if (end == at + 1 || *end != '\0' || percent < 0)
+        return 1.0f;
 
-    fifo_remove_data(f, (unsigned char *) in, len);
+    return percent / 100.0f;
+}
 
-    for (s = 0; s < (len / sizeof(int16_t)); s++) {
-        /* FIXME: Ehhh, this'd be better as floats. With this algorithm,
-         * samples mixed after being clipped will have undue weight. But
-         * if we're clipping, then we're distorted anyway, so whatever. */
-        if (out[s] + in[s] > INT16_MAX)
-            out[s] = INT16_MAX;
-        else if (out[s] + in[s] < -INT16_MAX)
-            out[s] = -INT16_MAX;
-        else
-            out[s] += in[s];
-    }
+static int ensure_mix_buffers(struct audio_data *data, int bytes)
+{
+    float *mix;
+    int16_t *scratch;
+
+    if (bytes <= data->mix_bytes)
+        return TRUE;
+
+    mix = realloc(data->mix_buffer, bytes / sizeof(int16_t) * sizeof(float));
+    if (mix)
+        data->mix_buffer = mix;
+    scratch = realloc(data->mix_scratch, bytes);
+    if (scratch)
+        data->mix_scratch = scratch;
+    if (!mix || !scratch)
+        return FALSE;
+
+    data->mix_bytes = bytes;
+    return TRUE;
+}
 
-    free(in);
+static void mix_in_one_fifo(struct audio_data *data, struct fifo_data *f, int len)
+{
+    if (len > f->len)
+        len = f->len;
+
+    fifo_remove_data(f, (unsigned char *) data->mix_scratch, len);
+    spiceqxl_mix_add(data->mix_buffer, data->mix_scratch, f->gain,
+                     len / sizeof(int16_t));
 }
 
 /* a helper for process_fifos() */
@@ -159,6 +245,7 @@ static void mix_in_fifos(qxl_screen_t *qxl)
     int i;
     struct audio_data *data = qxl->playback_opaque;
     struct fifo_data *f;
+    int n;
 
     if (data->spice_buffer) {
         memset(data->spice_buffer, 0, data->spice_buffer_bytes);
@@ -167,70 +254,187 @@ static void mix_in_fifos(qxl_screen_t *qxl)
     if (data->fifo_count == 0)
         return;
 
-    /* First fifo can just be copied */
     f = &data->fifos[0];
-    fifo_remove_data(f, (unsigned char *) data->spice_buffer, min(data->spice_buffer_bytes, f->len));
+    if (!data->spice_buffer || (data->fifo_count == 1 && f->gain == 1.0f)) {
+        /* A lone fifo can just be copied, and without a buffer to
+         * fill the data is simply dropped */
+        for (i = 0; i < data->fifo_count; i++) {
+            f = &data->fifos[i];
+            fifo_remove_data(f, (unsigned char *) data->spice_buffer,
+                             min(data->spice_buffer_bytes, f->len));
+        }
+        return;
+    }
 
-    /* Extra fifos need to be mixed in */
-    for (i = 1; i < data->fifo_count; i++) {
-        f = &data->fifos[i];
-        if (f->len > 0) {
-            if (data->spice_buffer) {
-                mix_in_one_fifo(f, (int16_t *) data->spice_buffer, data->spice_buffer_bytes);
-            } else {
-                fifo_remove_data(f, NULL, min(data->spice_buffer_bytes, f->len));
-            }
+    if (!ensure_mix_buffers(data, data->spice_buffer_bytes)) {
+        static int once = 0;
+        if (!once) {
+            ErrorF("playback: out of memory for mixing, dropping audio\n");
+            ++once;
+        }
+        for (i = 0; i < data->fifo_count; i++) {
+            f = &data->fifos[i];
+            fifo_remove_data(f, NULL, min(data->spice_buffer_bytes, f->len));
         }
+        return;
     }
+
+    n = data->spice_buffer_bytes / sizeof(int16_t);
+    memset(data->mix_buffer, 0, n * sizeof(float));
+
+    for (i = 0; i < data->fifo_count; i++) {
+        f = &data->fifos[i];
+        if (f->len > 0)
+            mix_in_one_fifo(data, f, data->spice_buffer_bytes);
+    }
+
+    spiceqxl_mix_clamp(data->mix_buffer, (int16_t *) data->spice_buffer, n);
 }
 
-/* a helper for process_fifos() */
-static int can_feed(struct audio_data *data)
+static uint64_t monotonic_ns(void)
 {
-    struct timeval end, diff;
+    struct timespec ts;
 
-    gettimeofday(&end, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-    if (end.tv_sec > data->fed_through_time.tv_sec ||
-        (end.tv_sec == data->fed_through_time.tv_sec &&
-         end.tv_usec >= data->fed_through_time.tv_usec)) {
-        data->fed_through_time.tv_sec = data->fed_through_time.tv_usec = 0;
-        data->remainder = 0;
-        return 1;
+/* a helper for did_feed() */
+static void adapt_feed_depth(struct audio_data *data, int underrun, uint64_t ahead)
+{
+    if (underrun) {
+        data->underruns++;
+        data->feed_periods = min(data->feed_periods + 2, data->max_feed_periods);
+        data->window_periods = 0;
+        data->window_min_ahead = UINT64_MAX;
+        return;
     }
 
-    timersub(&data->fed_through_time, &end, &diff);
-    if (diff.tv_sec == 0 && diff.tv_usec < PERIOD_MS * 1000 * FEED_BUFFER_PERIODS)
+    if (ahead < data->window_min_ahead)
+        data->window_min_ahead = ahead;
+
+    if (++data->window_periods < FEED_WINDOW_PERIODS)
+        return;
+
+    /* The jitter never ate into the last two periods; we can afford less */
+    if (data->window_min_ahead > 2 * data->period_ns &&
+        data->feed_periods > MIN_FEED_PERIODS)
+        data->feed_periods--;
+
+    data->window_periods = 0;
+    data->window_min_ahead = UINT64_MAX;
+}
+
+/* a helper for process_fifos(); only a check, did_feed() does the
+ * accounting so a chunk asked about twice is still counted once */
+static int can_feed(struct audio_data *data)
+{
+    uint64_t now = monotonic_ns();
+
+    if (data->fed_through == 0 || now >= data->fed_through)
         return 1;
 
-    return 0;
+    return data->fed_through - now < data->feed_periods * data->period_ns;
 }
 
 /* a helper for process_fifos() */
-static void did_feed(struct audio_data *data, int len)
+static void did_feed(qxl_screen_t *qxl, struct audio_data *data, int len)
+{
+    uint64_t now = monotonic_ns();
+    uint64_t total, ahead;
+
+    if (data->fed_through && now >= data->fed_through) {
+        /* Only running dry in the middle of a stream is an underrun,
+         * not resuming after a pause */
+        if (now - data->fed_through < IDLE_MS * NSEC_PER_MS)
+            adapt_feed_depth(data, TRUE, 0);
+        data->fed_through = 0;
+    }
+
+    if (data->fed_through == 0) {
+        data->fed_through = now;
+        data->remainder = 0;
+    } else {
+        ahead = data->fed_through - now;
+        data->feeds++;
+        data->latency_sum += ahead;
+        if (ahead > data->latency_max)
+            data->latency_max = ahead;
+        adapt_feed_depth(data, FALSE, ahead);
+    }
+
+    total = data->remainder + (uint64_t) len * data->period_ns;
+    data->fed_through += total / data->period_bytes;
+    data->remainder = total % data->period_bytes;
+}
+
+static uint64_t thread_cpu_ns(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+        return 0;
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* a helper for put_samples() */
+static void report_usage(qxl_screen_t *qxl, struct audio_data *data)
 {
-    struct timeval diff;
+    uint64_t now = monotonic_ns();
+    uint64_t elapsed;
 
-    if (data->fed_through_time.tv_sec == 0 && data->fed_through_time.tv_usec == 0)
-        gettimeofday(&data->fed_through_time, NULL);
+    if (data->report_start == 0) {
+        data->report_start = now;
+        data->report_bytes = data->bytes_fed;
+        data->report_encode_ns = data->encode_ns;
+        return;
+    }
+
+    elapsed = now - data->report_start;
+    if (elapsed < REPORT_INTERVAL_S * 1000 * NSEC_PER_MS)
+        return;
 
-    diff.tv_sec = 0;
-    diff.tv_usec = (data->remainder + (len * PERIOD_MS * 1000)) / data->period_bytes;
-    data->remainder = (data->remainder + (len * PERIOD_MS * 1000)) % data->period_bytes;
+    xf86DrvMsgVerb(qxl->pScrn->scrnIndex, X_INFO, 3,
+                   "Playback: %u kbit/s of PCM to the server, %u.%02u%% CPU handing it over\n",
+                   (unsigned) ((data->bytes_fed - data->report_bytes) * 8 * 1000000 / elapsed),
+                   (unsigned) ((data->encode_ns - data->report_encode_ns) * 100 / elapsed),
+                   (unsigned) ((data->encode_ns - data->report_encode_ns) * 10000 / elapsed % 100));
 
-    timeradd(&data->fed_through_time, &diff, &data->fed_through_time);
+    data->report_start = now;
+    data->report_bytes = data->bytes_fed;
+    data->report_encode_ns = data->encode_ns;
+}
+
+/* Encoding, when the server compresses, happens in here */
+static void put_samples(qxl_screen_t *qxl, struct audio_data *data, int len)
+{
+    uint64_t cpu = thread_cpu_ns();
+
+    spice_server_playback_put_samples(&qxl->playback_sin, data->spice_buffer);
+    data->spice_buffer = NULL;
+
+    data->encode_ns += thread_cpu_ns() - cpu;
+    data->bytes_fed += len;
+    report_usage(qxl, data);
+}
+
+static void get_spice_buffer(qxl_screen_t *qxl, struct audio_data *data)
+{
+    uint32_t chunk_frames;
+
+    if (data->spice_buffer)
+        return;
+
+    spice_server_playback_get_buffer(&qxl->playback_sin, &data->spice_buffer, &chunk_frames);
+    data->spice_buffer_bytes = data->spice_buffer ?
+        chunk_frames * sizeof(int16_t) * SPICE_INTERFACE_PLAYBACK_CHAN :
+        data->period_bytes * READ_BUFFER_PERIODS;
 }
 
 static int process_fifos(qxl_screen_t *qxl, struct audio_data *data, int maxlen)
 {
     while (maxlen > 0) {
-        if (! data->spice_buffer) {
-            uint32_t chunk_frames;
-            spice_server_playback_get_buffer(&qxl->playback_sin, &data->spice_buffer, &chunk_frames);
-            data->spice_buffer_bytes = data->spice_buffer ?
-                chunk_frames * sizeof(int16_t) * SPICE_INTERFACE_PLAYBACK_CHAN :
-                data->period_bytes * READ_BUFFER_PERIODS;
-        }
+        get_spice_buffer(qxl, data);
 
         if (! can_feed(data)) {
             return FALSE;
@@ -238,17 +442,58 @@ static int process_fifos(qxl_screen_t *qxl, struct audio_data *data, int maxlen)
 
         mix_in_fifos(qxl);
 
-        did_feed(data, data->spice_buffer_bytes);
+        did_feed(qxl, data, data->spice_buffer_bytes);
         maxlen -= data->spice_buffer_bytes;
 
         if (data->spice_buffer) {
-            spice_server_playback_put_samples(&qxl->playback_sin, data->spice_buffer);
-            data->spice_buffer = NULL;
+            put_samples(qxl, data, data->spice_buffer_bytes);
         }
     }
     return TRUE;
 }
 
+/* a helper for read_from_fifos(); a lone fifo with nothing buffered
+   can be read straight into the spice buffer, as long as the client
+   is ready for more.  */
+static int can_read_direct(qxl_screen_t *qxl, struct audio_data *data, struct fifo_data *f)
+{
+    if (data->fifo_count != 1 || !data->active || f->len || f->gain != 1.0f)
+        return FALSE;
+
+    get_spice_buffer(qxl, data);
+
+    return data->spice_buffer && data->spice_buffer_bytes <= f->size && can_feed(data);
+}
+
+/* a helper for read_from_fifos() */
+static int fifo_read_direct(qxl_screen_t *qxl, struct audio_data *data, struct fifo_data *f)
+{
+    int total = 0;
+    int rc;
+
+    for (;;) {
+        rc = read(f->fd, data->spice_buffer, data->spice_buffer_bytes);
+        if (rc <= 0)
+            return total && rc < 0 ? total : rc;
+
+        if (rc < data->spice_buffer_bytes) {
+            /* Not a whole chunk yet; keep it for the next round */
+            memcpy(f->buffer, data->spice_buffer, rc);
+            f->head = 0;
+            f->len = rc;
+            return total + rc;
+        }
+
+        did_feed(qxl, data, rc);
+        put_samples(qxl, data, rc);
+        total += rc;
+
+        get_spice_buffer(qxl, data);
+        if (!data->spice_buffer || !can_feed(data))
+            return total;
+    }
+}
+
 /* a helper for read_from_fifos() */
 static void condense_fifos(qxl_screen_t *qxl)
 {
@@ -291,7 +536,10 @@ static void read_from_fifos(int fd, int event, void *opaque)
         if (f->size - f->len > 0 && f->fd >= 0) {
             int rc;
 
-            rc = fifo_read(f);
+            if (can_read_direct(qxl, data, f))
+                rc = fifo_read_direct(qxl, data, f);
+            else
+                rc = fifo_read(f);
             if (rc == -1 && (errno == EAGAIN || errno == EINTR))
                 /* no new data to read */;
             else if (rc <= 0) {
@@ -333,8 +581,8 @@ static void read_from_fifos(int fd, int event, void *opaque)
 
     if (!process_fifos(qxl, data, maxlen)) {
         /* There is still some fifo data to process */
-        qxl->core->timer_start(data->wall_timer, PERIOD_MS);
-        data->wall_timer_type = PERIOD_MS;
+        qxl->core->timer_start(data->wall_timer, data->period_ms);
+        data->wall_timer_type = data->period_ms;
 
     } else if (data->fifo_count) {
         /* All the fifo data was processed. Wait for more */
@@ -417,7 +665,10 @@ static void handle_one_change(qxl_screen_t *qxl, struct inotify_event *e)
             return;
         }
 
-        ErrorF("playback: opened FIFO '%s' as %d:%d\n", e->name, data->fifo_count, f->fd);
+        f->gain = fifo_name_gain(e->name);
+
+        ErrorF("playback: opened FIFO '%s' as %d:%d, gain %d%%\n", e->name,
+               data->fifo_count, f->fd, (int) (f->gain * 100 + 0.5f));
 
         data->fifo_count++;
 
@@ -465,26 +716,45 @@ static const SpicePlaybackInterface playback_sif = {
     }
 };
 
+/* A lower rate is how the bitrate of a compressed stream is brought down */
+static int playback_rate(qxl_screen_t *qxl)
+{
+#if SPICE_INTERFACE_PLAYBACK_MAJOR > 1 || SPICE_INTERFACE_PLAYBACK_MINOR >= 3
+    if (qxl->playback_rate)
+        return qxl->playback_rate;
+    return spice_server_get_best_playback_rate(&qxl->playback_sin);
+#else
+    return SPICE_INTERFACE_PLAYBACK_FREQ;
+#endif
+}
+
 static void audio_initialize (qxl_screen_t *qxl)
 {
     int i;
     struct audio_data *data = qxl->playback_opaque;
-    int freq = SPICE_INTERFACE_PLAYBACK_FREQ;
+    int freq = playback_rate(qxl);
     int period_frames;
     int frame_bytes;
+    int ring_bytes;
 
-#if SPICE_INTERFACE_PLAYBACK_MAJOR > 1 || SPICE_INTERFACE_PLAYBACK_MINOR >= 3
-    freq = spice_server_get_best_playback_rate(&qxl->playback_sin);
-#endif
-
-    period_frames = freq * PERIOD_MS / 1000;
+    data->period_ms = qxl->playback_period;
+    period_frames = freq * data->period_ms / 1000;
     frame_bytes = sizeof(int16_t) * SPICE_INTERFACE_PLAYBACK_CHAN;
     data->period_bytes = period_frames * frame_bytes;
+    data->period_ns = data->period_ms * NSEC_PER_MS;
+    data->feed_periods = max(qxl->playback_latency / data->period_ms, MIN_FEED_PERIODS);
+    data->max_feed_periods = 2 * data->feed_periods;
+    data->window_min_ahead = UINT64_MAX;
+
+    ErrorF("playback: %d Hz, %d ms periods, %d ms ahead\n",
+           freq, data->period_ms, data->feed_periods * data->period_ms);
 
+    ring_bytes = max(data->period_bytes * READ_BUFFER_PERIODS,
+                     SPICE_CHUNK_FRAMES * frame_bytes);
     for (i = 0; i < MAX_FIFOS; ++i) {
         data->fifos[i].fd = -1;
-        data->fifos[i].size = data->period_bytes * READ_BUFFER_PERIODS;
-        data->fifos[i].buffer = calloc(1, data->fifos[i].size);
+        data->fifos[i].gain = 1.0f;
+        fifo_alloc_buffer(&data->fifos[i], ring_bytes);
     }
 }
 
@@ -510,8 +780,7 @@ qxl_add_spice_playback_interface (qxl_screen_t *qxl)
     }
 
 #if SPICE_INTERFACE_PLAYBACK_MAJOR > 1 || SPICE_INTERFACE_PLAYBACK_MINOR >= 3
-    spice_server_set_playback_rate(&qxl->playback_sin,
-            spice_server_get_best_playback_rate(&qxl->playback_sin));
+    spice_server_set_playback_rate(&qxl->playback_sin, playback_rate(qxl));
 #else
     /* disable CELT */
     ret = spice_server_set_playback_compression(qxl->spice_server, 0);
@@ -545,3 +814,24 @@ qxl_add_spice_playback_interface (qxl_screen_t *qxl)
 #endif
     return 0;
 }
+
+void
+qxl_playback_log_stats (qxl_screen_t *qxl)
+{
+    struct audio_data *data = qxl->playback_opaque;
+
+    if (!data)
+        return;
+
+    xf86DrvMsg(qxl->pScrn->scrnIndex, X_INFO,
+               "Playback: %u underruns, latency %u ms average, %u ms max, "
+               "feeding %d periods ahead, period %u us\n",
+               data->underruns,
+               data->feeds ? (unsigned) (data->latency_sum / data->feeds / NSEC_PER_MS) : 0,
+               (unsigned) (data->latency_max / NSEC_PER_MS),
+               data->feed_periods, (unsigned) (data->period_ns / 1000));
+    xf86DrvMsg(qxl->pScrn->scrnIndex, X_INFO,
+               "Playback: %llu KiB of PCM to the server, %llu ms CPU handing it over\n",
+               (unsigned long long) (data->bytes_fed / 1024),
+               (unsigned long long) (data->encode_ns / NSEC_PER_MS));
+}
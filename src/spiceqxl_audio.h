@@ -27,5 +27,6 @@
 #include <spice.h>
 
 int qxl_add_spice_playback_interface(qxl_screen_t *qxl);
+void qxl_playback_log_stats(qxl_screen_t *qxl);
 
 #endif
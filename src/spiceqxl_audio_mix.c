@@ -0,0 +1,70 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "spiceqxl_audio_mix.h"
+
+/* Summing in floats and clamping once at the end keeps clipped
+ * samples from weighing more than the others.
+ *
+ * The loops work in fixed blocks so that the compiler vectorizes
+ * them at -O2 too, where it won't for a loop of unknown length.
+ */
+#define MIX_BLOCK 8
+
+void spiceqxl_mix_add(float *restrict out, const int16_t *restrict in, float gain, int n)
+{
+    int s, k;
+
+    if (gain == 1.0f) {
+        for (s = 0; s + MIX_BLOCK <= n; s += MIX_BLOCK)
+            for (k = 0; k < MIX_BLOCK; k++)
+                out[s + k] += in[s + k];
+        for (; s < n; s++)
+            out[s] += in[s];
+    } else {
+        for (s = 0; s + MIX_BLOCK <= n; s += MIX_BLOCK)
+            for (k = 0; k < MIX_BLOCK; k++)
+                out[s + k] += in[s + k] * gain;
+        for (; s < n; s++)
+            out[s] += in[s] * gain;
+    }
+}
+
+static inline int16_t clamp_sample(float v)
+{
+    v = v > INT16_MAX ? INT16_MAX : v;
+    v = v < INT16_MIN ? INT16_MIN : v;
+    return (int16_t) v;
+}
+
+void spiceqxl_mix_clamp(const float *restrict in, int16_t *restrict out, int n)
+{
+    int s, k;
+
+    for (s = 0; s + MIX_BLOCK <= n; s += MIX_BLOCK)
+        for (k = 0; k < MIX_BLOCK; k++)
+            out[s + k] = clamp_sample(in[s + k]);
+    for (; s < n; s++)
+        out[s] = clamp_sample(in[s]);
+}
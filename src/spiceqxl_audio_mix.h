@@ -0,0 +1,36 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef SPICEQXL_AUDIO_MIX_H
+#define SPICEQXL_AUDIO_MIX_H
+
+#include <stdint.h>
+
+/* Sample kernels for mixing playback streams, kept apart from the spice
+ * plumbing so they can be benchmarked on their own.
+ */
+
+/* Adds n samples of in, scaled by gain, to out */
+void spiceqxl_mix_add(float *restrict out, const int16_t *restrict in, float gain, int n);
+
+/* Stores n mixed samples as int16, clipping the ones out of range */
+void spiceqxl_mix_clamp(const float *restrict in, int16_t *restrict out, int n);
+
+#endif
@@ -27,6 +27,7 @@
 
 #include "qxl.h"
 #include "spiceqxl_display.h"
+#include "spiceqxl_release.h"
 
 #ifndef container_of
 #define container_of(ptr, type, member) ({                      \
@@ -40,18 +41,6 @@
  * all the others are there).
  * Practically speaking the only difference between the two is extra checking in this version,
  * and usage (this one takes an extra parameter, the previous is meant to be used by assignment) */
-#undef SPICE_RING_PROD_ITEM
-#define SPICE_RING_PROD_ITEM(r, ret) {                                  \
-        typeof(r) start = r;                                            \
-        typeof(r) end = r + 1;                                          \
-        uint32_t prod = (r)->prod & SPICE_RING_INDEX_MASK(r);           \
-        typeof(&(r)->items[prod]) m_item = &(r)->items[prod];           \
-        if (!((uint8_t*)m_item >= (uint8_t*)(start) && (uint8_t*)(m_item + 1) <= (uint8_t*)(end))) { \
-            abort();                                                    \
-        }                                                               \
-        ret = &m_item->el;                                              \
-    }
-
 #undef SPICE_RING_CONS_ITEM
 #define SPICE_RING_CONS_ITEM(r, ret) {                                  \
         typeof(r) start = r;                                            \
@@ -127,7 +116,7 @@ static void interface_get_init_info(QXLInstance *sin, QXLDevInitInfo *info)
     info->num_memslots_groups = NUM_MEMSLOTS_GROUPS;
     info->internal_groupslot_id = 0;
     info->qxl_ram_size = qxl->shadow_rom.num_pages << TARGET_PAGE_BITS;
-    info->n_surfaces = NUM_SURFACES;
+    info->n_surfaces = qxl->n_surfaces;
 }
 
 void qxl_send_events(qxl_screen_t *qxl, int events)
@@ -180,72 +169,13 @@ static int interface_req_cmd_notification(QXLInstance *sin)
     return wait;
 }
 
-/* called from spice server thread context only */
-static inline void qxl_push_free_res(qxl_screen_t *qxl, int flush)
-{
-    QXLRam *header = get_ram_header(qxl);
-    QXLReleaseRing *ring = &header->release_ring;
-    uint64_t *item;
-    int notify;
-
-#define QXL_FREE_BUNCH_SIZE 32
-
-    if (ring->prod - ring->cons + 1 == ring->num_items) {
-        /* ring full -- can't push */
-        return;
-    }
-    if (!flush && qxl->oom_running) {
-        /* collect everything from oom handler before pushing */
-        return;
-    }
-    if (!flush && qxl->num_free_res < QXL_FREE_BUNCH_SIZE) {
-        /* collect a bit more before pushing */
-        return;
-    }
-
-    SPICE_RING_PUSH(ring, notify);
-    dprint(qxl, 2, "free: push %d items, notify %s, ring %d/%d [%d,%d]\n",
-           qxl->num_free_res, notify ? "yes" : "no",
-           ring->prod - ring->cons, ring->num_items,
-           ring->prod, ring->cons);
-    if (notify) {
-        qxl_send_events(qxl, QXL_INTERRUPT_DISPLAY);
-    }
-    SPICE_RING_PROD_ITEM(ring, item);
-    *item = 0;
-    qxl->num_free_res = 0;
-    qxl->last_release = NULL;
-}
-
 /* called from spice server thread context only */
 static void interface_release_resource(QXLInstance *sin,
                                        struct QXLReleaseInfoExt ext)
 {
     qxl_screen_t *qxl = container_of(sin, qxl_screen_t, display_sin);
-    QXLRam *ram = get_ram_header(qxl);
-    QXLReleaseRing *ring;
-    uint64_t *item, id;
-
-    /*
-     * ext->info points into guest-visible memory
-     * pci bar 0, $command.release_info
-     */
-    ring = &ram->release_ring;
-    SPICE_RING_PROD_ITEM(ring, item);
-    if (*item == 0) {
-        /* stick head into the ring */
-        id = ext.info->id;
-        ext.info->next = 0;
-        *item = id;
-    } else {
-        /* append item to the list */
-        qxl->last_release->next = ext.info->id;
-        ext.info->next = 0;
-    }
-    qxl->last_release = ext.info;
-    qxl->num_free_res++;
-    dprint(qxl, 3, "%4d\r", qxl->num_free_res);
-    qxl_push_free_res(qxl, 0);
+
+    qxl_chain_free_res(qxl, ext.info);
 }
 
 /* called from spice server thread context only */
@@ -340,7 +270,7 @@ void qxl_add_spice_display_interface(qxl_screen_t *qxl)
      * that were added directly from qemu/hw/qxl.c */
     qxl->cmdflags = 0;
     qxl->oom_running = 0;
-    qxl->num_free_res = 0;
+    qxl_init_free_res(qxl);
 
     qxl->display_sin.base.sif = &qxl_interface.base;
     qxl->display_sin.id = 0;
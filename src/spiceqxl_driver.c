@@ -119,7 +119,7 @@ void init_qxl_rom(qxl_screen_t* qxl, uint32_t rom_size)
     rom->slot_id_bits  = MEMSLOT_SLOT_BITS;
     rom->slots_start   = 0;
     rom->slots_end     = 1;
-    rom->n_surfaces    = (NUM_SURFACES);
+    rom->n_surfaces    = qxl->n_surfaces;
 
     for (i = 0, m = 0; i < (SPICE_ARRAY_SIZE(qxl_modes)); i++) {
         fb = qxl_modes[i].y_res * qxl_modes[i].stride;
@@ -32,6 +32,7 @@
 #include <xserver-properties.h>
 #include <list.h>
 #include <input.h>
+#include <ptrveloc.h>
 #include <xkbsrv.h>
 #include <spice.h>
 #include "qxl.h"
@@ -82,6 +83,10 @@ typedef struct XSpiceKbd {
     int              escape;
 } XSpiceKbd;
 
+static Bool xspice_pointer_accel(void);
+static void xspice_pointer_register_flush(void);
+static void xspice_pointer_unregister_flush(void);
+
 static int xspice_pointer_proc(DeviceIntPtr pDevice, int onoff)
 {
     DevicePtr pDev = (DevicePtr)pDevice;
@@ -104,11 +109,18 @@ static int xspice_pointer_proc(DeviceIntPtr pDevice, int onoff)
             axes_labels[1] = XIGetKnownProperty(AXIS_LABEL_PROP_REL_Y);
             InitPointerDeviceStruct(pDev, map, BUTTONS,btn_labels,(PtrCtrlProcPtr)NoopDDA,
                 GetMotionHistorySize(), 2, axes_labels);
+            // spice clients send deltas the client OS has already
+            // accelerated, so by default pass them through unchanged.
+            if (!xspice_pointer_accel()) {
+                InitPointerAccelerationScheme(pDevice, PtrAccelNoOp);
+            }
             break;
         case DEVICE_ON:
+            xspice_pointer_register_flush();
             pDev->on = TRUE;
             break;
         case DEVICE_OFF:
+            xspice_pointer_unregister_flush();
             pDev->on = FALSE;
             break;
     }
@@ -268,21 +280,110 @@ typedef struct XSpicePointer {
     SpiceMouseInstance  mouse;
     SpiceTabletInstance tablet;
     int width, height, x, y;
-    Bool absolute;
+    Bool absolute;      /* last motion came from the tablet */
+    Bool accel;         /* leave server acceleration on relative motion */
+    int dx, dy, dz;     /* relative motion not yet posted this cycle */
     InputInfoPtr     pInfo; /* xf86 device handle to post events */
 } XSpicePointer;
 
 static XSpicePointer *g_xspice_pointer;
+static uint32_t g_buttons_state;
+
+static Bool xspice_pointer_accel(void)
+{
+    return g_xspice_pointer->accel;
+}
+
+// For some reason spice switches the second and third button, undo that.
+// basically undo RED_MOUSE_STATE_TO_LOCAL
+static uint32_t spice_to_x_buttons(uint32_t buttons_state)
+{
+    return (buttons_state & SPICE_MOUSE_BUTTON_MASK_LEFT) |
+        ((buttons_state & SPICE_MOUSE_BUTTON_MASK_MIDDLE) << 1) |
+        ((buttons_state & SPICE_MOUSE_BUTTON_MASK_RIGHT) >> 1) |
+        (buttons_state & ~(SPICE_MOUSE_BUTTON_MASK_LEFT | SPICE_MOUSE_BUTTON_MASK_MIDDLE
+                          |SPICE_MOUSE_BUTTON_MASK_RIGHT));
+}
+
+/* Post the relative motion accumulated since the last flush as a single
+ * event, then the wheel as clicks of buttons 4 and 5. Returns TRUE if
+ * anything was posted. */
+static Bool flush_relative_motion(XSpicePointer *spice_pointer)
+{
+    DeviceIntPtr dev = spice_pointer->pInfo->dev;
+    int button;
+    int dz = spice_pointer->dz;
+
+    if (!spice_pointer->dx && !spice_pointer->dy && !dz) {
+        return FALSE;
+    }
+    if (spice_pointer->dx || spice_pointer->dy) {
+        xf86PostMotionEvent(dev, 0, 0, 2, spice_pointer->dx, spice_pointer->dy);
+    }
+    // spice sends negative dz for wheel up
+    button = dz < 0 ? 4 : 5;
+    for (; dz != 0; dz += dz < 0 ? 1 : -1) {
+        xf86PostButtonEvent(dev, 0, button, 1, 0, 0);
+        xf86PostButtonEvent(dev, 0, button, 0, 0, 0);
+    }
+    spice_pointer->dx = spice_pointer->dy = spice_pointer->dz = 0;
+    return TRUE;
+}
+
+/* Relative motion arrives one spice message at a time; accumulate it and
+ * post once per pass through the X main loop, just before it would sleep.
+ * Something was queued, so don't let the server block before handling it. */
+#if GET_ABI_MAJOR(ABI_VIDEODRV_VERSION) >= 23
+static void xspice_pointer_block_handler(void *data, void *timeout)
+#else
+static void xspice_pointer_block_handler(pointer data, OSTimePtr timeout,
+                                         pointer readmask)
+#endif
+{
+    /* in absolute mode there is nothing to flush; relative motion
+     * clears absolute before it accumulates */
+    if (g_xspice_pointer->absolute) {
+        return;
+    }
+    if (flush_relative_motion(g_xspice_pointer)) {
+        AdjustWaitForDelay(timeout, 0);
+    }
+}
+
+static void xspice_pointer_register_flush(void)
+{
+    RegisterBlockAndWakeupHandlers(xspice_pointer_block_handler,
+                                   (ServerWakeupHandlerProcPtr)NoopDDA,
+                                   g_xspice_pointer);
+}
+
+static void xspice_pointer_unregister_flush(void)
+{
+    RemoveBlockAndWakeupHandlers(xspice_pointer_block_handler,
+                                 (ServerWakeupHandlerProcPtr)NoopDDA,
+                                 g_xspice_pointer);
+    g_xspice_pointer->dx = g_xspice_pointer->dy = g_xspice_pointer->dz = 0;
+}
 
 static void mouse_motion(SpiceMouseInstance *sin, int dx, int dy, int dz,
                          uint32_t buttons_state)
 {
-    // TODO
+    XSpicePointer *spice_pointer = container_of(sin, XSpicePointer, mouse);
+
+    spice_pointer->absolute = FALSE;
+    spice_pointer->dx += dx;
+    spice_pointer->dy += dy;
+    spice_pointer->dz += dz;
+
+    buttons_state = spice_to_x_buttons(buttons_state);
+    if (buttons_state != g_buttons_state) {
+        spiceqxl_tablet_buttons(buttons_state);
+    }
 }
 
 static void mouse_buttons(SpiceMouseInstance *sin, uint32_t buttons_state)
 {
-    // TODO
+    spiceqxl_tablet_buttons(spice_to_x_buttons(buttons_state));
 }
 
 static const SpiceMouseInterface mouse_interface = {
@@ -311,6 +412,8 @@ static void tablet_set_logical_size(SpiceTabletInstance* sin, int width, int hei
 void spiceqxl_tablet_position(int x, int y, uint32_t buttons_state)
 {
     // TODO: don't ignore buttons_state
+    flush_relative_motion(g_xspice_pointer);
+    g_xspice_pointer->absolute = TRUE;
     xf86PostMotionEvent(g_xspice_pointer->pInfo->dev, 1, 0, 2, x, y);
 }
 
@@ -322,29 +425,23 @@ static void tablet_position(SpiceTabletInstance* sin, int x, int y,
 
 void spiceqxl_tablet_buttons(uint32_t buttons_state)
 {
-    static uint32_t old_buttons_state = 0;
     int i;
 
+    // keep presses ordered after the motion that led up to them
+    flush_relative_motion(g_xspice_pointer);
     for (i = 0; i < BUTTONS; i++) {
-        if ((buttons_state ^ old_buttons_state) & (1 << i)) {
+        if ((buttons_state ^ g_buttons_state) & (1 << i)) {
             int action = (buttons_state & (1 << i));
             xf86PostButtonEvent(g_xspice_pointer->pInfo->dev, 0, i + 1, action, 0, 0);
         }
     }
-    old_buttons_state = buttons_state;
+    g_buttons_state = buttons_state;
 }
 
 static void tablet_buttons(SpiceTabletInstance *sin,
                            uint32_t buttons_state)
 {
-    // For some reason spice switches the second and third button, undo that.
-    // basically undo RED_MOUSE_STATE_TO_LOCAL
-    buttons_state = (buttons_state & SPICE_MOUSE_BUTTON_MASK_LEFT) |
-        ((buttons_state & SPICE_MOUSE_BUTTON_MASK_MIDDLE) << 1) |
-        ((buttons_state & SPICE_MOUSE_BUTTON_MASK_RIGHT) >> 1) |
-        (buttons_state & ~(SPICE_MOUSE_BUTTON_MASK_LEFT | SPICE_MOUSE_BUTTON_MASK_MIDDLE
-                          |SPICE_MOUSE_BUTTON_MASK_RIGHT));
-    spiceqxl_tablet_buttons(buttons_state);
+    spiceqxl_tablet_buttons(spice_to_x_buttons(buttons_state));
 }
 
 static void tablet_wheel(SpiceTabletInstance* sin, int wheel,
@@ -392,20 +489,38 @@ static int
 XSpicePointerPreInit(InputDriverPtr drv, InputInfoPtr pInfo, int flags)
 {
     XSpicePointer *spice_pointer;
+    char *mode;
+    Bool relative;
 
     g_xspice_pointer = spice_pointer = calloc(sizeof(*spice_pointer), 1);
     spice_pointer->mouse.base.sif  = &mouse_interface.base;
     spice_pointer->tablet.base.sif = &tablet_interface.base;
-    spice_pointer->absolute = TRUE;
     spice_pointer->pInfo = pInfo;
 
+    mode = xf86SetStrOption(pInfo->options, "Mode", "Absolute");
+    relative = xf86NameCmp(mode, "Relative") == 0;
+    if (!relative && xf86NameCmp(mode, "Absolute") != 0) {
+        xf86Msg(X_WARNING, "%s: unknown Mode \"%s\", using Absolute\n",
+                pInfo->name, mode);
+    }
+    free(mode);
+    spice_pointer->absolute = !relative;
+    spice_pointer->accel = xf86SetBoolOption(pInfo->options, "RelativeAcceleration", FALSE);
+
     pInfo->private = NULL;
     pInfo->type_name = unknown_type_string;
     pInfo->device_control = xspice_pointer_proc;
     pInfo->read_input = NULL;
     pInfo->switch_mode = NULL;
 
-    spice_server_add_interface(xspice_get_spice_server(), &spice_pointer->tablet.base);
+    /* The mouse lets spice fall back to server (relative) mode. Without the
+     * tablet, client (absolute) mode is only offered while a vdagent is
+     * connected and SpiceAgentMouse is on, so spice switches between the
+     * two as the agent comes and goes. */
+    spice_server_add_interface(xspice_get_spice_server(), &spice_pointer->mouse.base);
+    if (!relative) {
+        spice_server_add_interface(xspice_get_spice_server(), &spice_pointer->tablet.base);
+    }
     return Success;
 }
 
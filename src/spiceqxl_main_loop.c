@@ -24,10 +24,16 @@
 #endif
 
 #include <sys/time.h>
+#include <errno.h>
+#include <string.h>
 
 #include <spice.h>
 #include "spiceqxl_main_loop.h"
 
+#if GET_ABI_MAJOR(ABI_VIDEODRV_VERSION) < 23
+#include <sys/epoll.h>
+#endif
+
 static int spiceqxl_main_loop_debug = 0;
 
 #define DPRINTF(x, format, ...) { \
@@ -150,50 +156,36 @@ static inline RingItem *ring_prev(Ring *ring, RingItem *pos)
 
 static SpiceCoreInterface core;
 
-typedef struct SpiceTimer {
-    OsTimerPtr xorg_timer;
-    SpiceTimerFunc func;
-    void *opaque; // also stored in xorg_timer, but needed for timer_start
-} Timer;
-
-static CARD32 xorg_timer_callback(
-    OsTimerPtr xorg_timer,
-    CARD32 time,
-    pointer arg)
-{
-    SpiceTimer *timer = (SpiceTimer*)arg;
-
-    timer->func(timer->opaque);
-    return 0; // if non zero xorg does a TimerSet, we don't want that.
-}
-
+/* SpiceTimers are the driver's wheel timers */
 static SpiceTimer* timer_add(SpiceTimerFunc func, void *opaque)
 {
-    SpiceTimer *timer = calloc(sizeof(SpiceTimer), 1);
-
-    timer->func = func;
-    timer->opaque = opaque;
-    return timer;
+    return (SpiceTimer *)qxl_timer_add(func, opaque);
 }
 
 static void timer_start(SpiceTimer *timer, uint32_t ms)
 {
-    timer->xorg_timer = TimerSet(timer->xorg_timer, 0 /* flags */,
-                                 ms, xorg_timer_callback, timer);
+    qxl_timer_start((qxl_timer_t *)timer, ms);
 }
 
 static void timer_cancel(SpiceTimer *timer)
 {
-    TimerCancel(timer->xorg_timer);
+    qxl_timer_cancel((qxl_timer_t *)timer);
 }
 
 static void timer_remove(SpiceTimer *timer)
 {
-    TimerFree(timer->xorg_timer);
-    free(timer);
+    qxl_timer_remove((qxl_timer_t *)timer);
 }
 
 #if GET_ABI_MAJOR(ABI_VIDEODRV_VERSION) < 23
+/*
+ * All watches live in a single epoll set, whose fd is the only one we
+ * hand to the X server; it turns readable whenever any watch is ready
+ * for what it asked for, so a wakeup only costs one epoll_wait() and
+ * dispatches the ready watches alone.
+ */
+#define MAX_EPOLL_EVENTS 32
+
 struct SpiceWatch {
     RingItem link;
     int fd;
@@ -203,10 +195,38 @@ struct SpiceWatch {
     int remove;
 };
 
+static int epoll_fd = -1;
+
+/* Removed while dispatching, freed once the dispatch is over */
 Ring watches;
 
+static int dispatching = FALSE;
+
 int watch_count = 0;
 
+static uint32_t watch_epoll_events(int event_mask)
+{
+    uint32_t events = 0;
+
+    if (event_mask & SPICE_WATCH_EVENT_READ) {
+        events |= EPOLLIN;
+    }
+    if (event_mask & SPICE_WATCH_EVENT_WRITE) {
+        events |= EPOLLOUT;
+    }
+    return events;
+}
+
+static int watch_epoll_ctl(SpiceWatch *watch, int op)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = watch_epoll_events(watch->event_mask);
+    ev.data.ptr = watch;
+    return epoll_ctl(epoll_fd, op, watch->fd, &ev);
+}
+
 static SpiceWatch *watch_add(int fd, int event_mask, SpiceWatchFunc func, void *opaque)
 {
     SpiceWatch *watch = xnfalloc(sizeof(SpiceWatch));
@@ -219,43 +239,57 @@ static SpiceWatch *watch_add(int fd, int event_mask, SpiceWatchFunc func, void *
     watch->opaque = opaque;
     watch->remove = FALSE;
     ring_item_init(&watch->link);
-    ring_add(&watches, &watch->link);
+    if (event_mask && watch_epoll_ctl(watch, EPOLL_CTL_ADD) != 0) {
+        ErrorF("spice: cannot watch fd %d: %s\n", fd, strerror(errno));
+        free(watch);
+        return NULL;
+    }
     watch_count++;
     return watch;
 }
 
+/*
+ * A watch without events is taken out of the set: epoll reports hangups
+ * and errors regardless of the mask, which would keep the set readable
+ * with nobody to tell.
+ */
 static void watch_update_mask(SpiceWatch *watch, int event_mask)
 {
+    int op;
+
     DPRINTF(0, "fd %d to %d", watch->fd, event_mask);
+    if (watch->event_mask == event_mask) {
+        return;
+    }
+    if (!watch->event_mask) {
+        op = EPOLL_CTL_ADD;
+    } else if (!event_mask) {
+        op = EPOLL_CTL_DEL;
+    } else {
+        op = EPOLL_CTL_MOD;
+    }
     watch->event_mask = event_mask;
+    if (watch_epoll_ctl(watch, op) != 0) {
+        ErrorF("spice: cannot update watch on fd %d: %s\n",
+               watch->fd, strerror(errno));
+    }
 }
 
 static void watch_remove(SpiceWatch *watch)
 {
     DPRINTF(0, "remove %p (fd %d)", watch, watch->fd);
-    watch->remove = TRUE;
+    /* The fd may already be closed. That only drops it from the set
+     * once no other fd refers to the same open file description */
+    if (watch->event_mask) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+    }
     watch_count--;
-}
-
-static int set_watch_fds(fd_set *rfds, fd_set *wfds)
-{
-    SpiceWatch *watch;
-    RingItem *link;
-    RingItem *next;
-    int max_fd = -1;
-
-    RING_FOREACH_SAFE(link, next, &watches) {
-        watch = (SpiceWatch*)link;
-        if (watch->event_mask & SPICE_WATCH_EVENT_READ) {
-            FD_SET(watch->fd, rfds);
-            max_fd = watch->fd > max_fd ? watch->fd : max_fd;
-        }
-        if (watch->event_mask & SPICE_WATCH_EVENT_WRITE) {
-            FD_SET(watch->fd, wfds);
-            max_fd = watch->fd > max_fd ? watch->fd : max_fd;
-        }
+    if (dispatching) {
+        watch->remove = TRUE;
+        ring_add(&watches, &watch->link);
+    } else {
+        free(watch);
     }
-    return max_fd;
 }
 
 /*
@@ -265,73 +299,49 @@ static int set_watch_fds(fd_set *rfds, fd_set *wfds)
  */
 static void xspice_block_handler(pointer data, OSTimePtr timeout, pointer readmask)
 {
-    /* set all our fd's */
-    set_watch_fds((fd_set*)readmask, (fd_set*)readmask);
+    if (epoll_fd >= 0) {
+        FD_SET(epoll_fd, (fd_set*)readmask);
+    }
 }
 
-/*
- * xserver only calls wakeup_handler with the read fd_set, so we
- * must either patch it or do a polling select ourselves, this is the
- * latter approach. Since we are already doing a polling select, we
- * already select on all (we could avoid selecting on the read since
- * that *is* actually taken care of by the wakeup handler).
- */
-static void select_and_check_watches(void)
+static void dispatch_watches(void)
 {
-    fd_set rfds, wfds;
-    int max_fd = -1;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
     SpiceWatch *watch;
     RingItem *link;
     RingItem *next;
-    struct timeval timeout;
-    int retval;
-
-    FD_ZERO(&rfds);
-    FD_ZERO(&wfds);
-    max_fd = set_watch_fds(&rfds, &wfds);
-    watch = (SpiceWatch*)watches.next;
-    timeout.tv_sec = timeout.tv_usec = 0;
-    retval = select(max_fd + 1, &rfds, &wfds, NULL, &timeout);
-    if (retval > 0) {
-        RING_FOREACH_SAFE(link, next, &watches) {
-            watch = (SpiceWatch*)link;
-            if (!watch->remove && (watch->event_mask & SPICE_WATCH_EVENT_READ)
-                 && FD_ISSET(watch->fd, &rfds)) {
-                watch->func(watch->fd, SPICE_WATCH_EVENT_READ, watch->opaque);
-            }
-            if (!watch->remove && (watch->event_mask & SPICE_WATCH_EVENT_WRITE)
-                 && FD_ISSET(watch->fd, &wfds)) {
-                watch->func(watch->fd, SPICE_WATCH_EVENT_WRITE, watch->opaque);
-            }
-            if (watch->remove) {
-                ring_remove(&watch->link);
-                free(watch);
-            }
+    int n, i;
+
+    n = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, 0);
+
+    dispatching = TRUE;
+    for (i = 0; i < n; i++) {
+        watch = events[i].data.ptr;
+        /* like select(), report errors and hangups to whoever listens */
+        if (!watch->remove && (watch->event_mask & SPICE_WATCH_EVENT_READ)
+             && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+            watch->func(watch->fd, SPICE_WATCH_EVENT_READ, watch->opaque);
+        }
+        if (!watch->remove && (watch->event_mask & SPICE_WATCH_EVENT_WRITE)
+             && (events[i].events & (EPOLLOUT | EPOLLERR))) {
+            watch->func(watch->fd, SPICE_WATCH_EVENT_WRITE, watch->opaque);
         }
     }
-}
-
-static int no_write_watches(Ring *w)
-{
-    SpiceWatch *watch;
-    RingItem *link;
-    RingItem *next;
+    dispatching = FALSE;
 
-    RING_FOREACH_SAFE(link, next, w) {
+    RING_FOREACH_SAFE(link, next, &watches) {
         watch = (SpiceWatch*)link;
-        if (!watch->remove && (watch->event_mask & SPICE_WATCH_EVENT_WRITE))
-            return 0;
+        ring_remove(&watch->link);
+        free(watch);
     }
-
-    return 1;
 }
 
 static void xspice_wakeup_handler(pointer data, int nfds, pointer readmask)
 {
-    if (!nfds && no_write_watches(&watches)) {
+    if (nfds <= 0 || epoll_fd < 0 || !FD_ISSET(epoll_fd, (fd_set*)readmask)) {
         return;
     }
-    select_and_check_watches();
+    dispatch_watches();
 }
 
 #else /* GET_ABI_MAJOR(ABI_VIDEODRV_VERSION) < 23 */
@@ -420,6 +430,12 @@ SpiceCoreInterface *basic_event_loop_init(void)
 {
 #if GET_ABI_MAJOR(ABI_VIDEODRV_VERSION) < 23
     ring_init(&watches);
+    if (epoll_fd < 0) {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd < 0) {
+            FatalError("spice: epoll_create1 failed: %s\n", strerror(errno));
+        }
+    }
 #endif
     bzero(&core, sizeof(core));
     core.base.major_version = SPICE_INTERFACE_CORE_MAJOR;
@@ -0,0 +1,159 @@
+/*
+ * Copyright 2011 Red Hat, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "qxl.h"
+#include "spiceqxl_display.h"
+#include "spiceqxl_release.h"
+
+/* bounds checked, see the comment in spiceqxl_display.c */
+#undef SPICE_RING_PROD_ITEM
+#define SPICE_RING_PROD_ITEM(r, ret) {                                  \
+        typeof(r) start = r;                                            \
+        typeof(r) end = r + 1;                                          \
+        uint32_t prod = (r)->prod & SPICE_RING_INDEX_MASK(r);           \
+        typeof(&(r)->items[prod]) m_item = &(r)->items[prod];           \
+        if (!((uint8_t*)m_item >= (uint8_t*)(start) && (uint8_t*)(m_item + 1) <= (uint8_t*)(end))) { \
+            abort();                                                    \
+        }                                                               \
+        ret = &m_item->el;                                              \
+    }
+
+// TODO - reall dprint, this is just to get it compiling
+#define dprint(qxl, lvl, fmt, ...) printf(fmt, __VA_ARGS__)
+
+/*
+ * The release ring is single producer, single consumer: the spice worker
+ * thread produces here, the X thread consumes in qxl_garbage_collect.
+ *
+ * The producer owns the item at prod, plus last_release, num_free_res and
+ * free_bunch; released resources are chained onto the list headed by that
+ * item without the consumer seeing any of it. Publishing is a release store
+ * of prod, so the chain is visible before the consumer's acquire load of
+ * prod lets it follow it. The consumer hands slots back with a release
+ * store of cons, which we load with acquire before reusing a slot.
+ *
+ * Each push costs the X thread a wakeup, so releases are gathered into
+ * bunches. While the X thread is starved in qxl_allocnf every release is
+ * pushed at once; otherwise the bunch grows while pushed slots sit
+ * uncollected and shrinks back while the X thread keeps up.
+ */
+
+void qxl_init_free_res(qxl_screen_t *qxl)
+{
+    qxl->last_release = NULL;
+    qxl->num_free_res = 0;
+    qxl->free_bunch = QXL_FREE_BUNCH_MIN;
+    qxl->release_waiting = 0;
+}
+
+void qxl_push_free_res(qxl_screen_t *qxl, int flush)
+{
+    QXLRam *header = get_ram_header(qxl);
+    QXLReleaseRing *ring = &header->release_ring;
+    uint64_t *item;
+    uint32_t prod, cons;
+    int notify;
+
+    prod = ring->prod;
+    cons = __atomic_load_n(&ring->cons, __ATOMIC_ACQUIRE);
+    if (prod - cons + 1 == ring->num_items) {
+        /* ring full -- can't push */
+        return;
+    }
+    if (__atomic_load_n(&qxl->release_waiting, __ATOMIC_RELAXED)) {
+        /* X is waiting for memory, hand over whatever we have */
+        flush = 1;
+        qxl->free_bunch = QXL_FREE_BUNCH_MIN;
+    }
+    if (!flush && qxl->oom_running) {
+        /* collect everything from oom handler before pushing */
+        return;
+    }
+    if (!flush && qxl->num_free_res < qxl->free_bunch) {
+        /* collect a bit more before pushing */
+        return;
+    }
+    if (!flush) {
+        if (prod != cons && qxl->free_bunch < QXL_FREE_BUNCH_MAX) {
+            /* X hasn't collected the last push yet, it isn't short */
+            qxl->free_bunch *= 2;
+        } else if (prod == cons && qxl->free_bunch > QXL_FREE_BUNCH_MIN) {
+            qxl->free_bunch /= 2;
+        }
+    }
+
+    prod++;
+    __atomic_store_n(&ring->prod, prod, __ATOMIC_RELEASE);
+    /*
+     * Nothing on the X side asks for a notification today: it polls the
+     * ring from qxl_garbage_collect, and qxl_send_events is a stub. The
+     * fence orders the prod store before the notify_on_prod load, so a
+     * consumer that stores notify_on_prod, fences and then rechecks prod
+     * before sleeping can't miss this push.
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    notify = prod == __atomic_load_n(&ring->notify_on_prod, __ATOMIC_RELAXED);
+    dprint(qxl, 2, "free: push %d items, bunch %d, notify %s, ring %d/%d [%d,%d]\n",
+           qxl->num_free_res, qxl->free_bunch, notify ? "yes" : "no",
+           prod - cons, ring->num_items, prod, cons);
+    if (notify) {
+        qxl_send_events(qxl, QXL_INTERRUPT_DISPLAY);
+    }
+    SPICE_RING_PROD_ITEM(ring, item);
+    *item = 0;
+    qxl->num_free_res = 0;
+    qxl->last_release = NULL;
+}
+
+void qxl_chain_free_res(qxl_screen_t *qxl, QXLReleaseInfo *info)
+{
+    QXLRam *ram = get_ram_header(qxl);
+    QXLReleaseRing *ring;
+    uint64_t *item, id;
+
+    /*
+     * info points into guest-visible memory
+     * pci bar 0, $command.release_info
+     */
+    ring = &ram->release_ring;
+    SPICE_RING_PROD_ITEM(ring, item);
+    if (*item == 0) {
+        /* stick head into the ring */
+        id = info->id;
+        info->next = 0;
+        *item = id;
+    } else {
+        /* append item to the list */
+        qxl->last_release->next = info->id;
+        info->next = 0;
+    }
+    qxl->last_release = info;
+    qxl->num_free_res++;
+    dprint(qxl, 3, "%4d\r", qxl->num_free_res);
+    qxl_push_free_res(qxl, 0);
+}
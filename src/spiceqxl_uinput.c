@@ -21,35 +21,54 @@
 static const char *uinput_filename;
 static int uinput_fd;
 static SpiceWatch *uinput_watch;
-static struct input_event inp_event;
+
+/* Everything that is available is read at once, and the events are
+ * gathered up to each SYN_REPORT, so that a frame turns into a single
+ * motion with both axes followed by its button changes.
+ */
+#define UINPUT_BATCH 64
+
+static struct input_event inp_events[UINPUT_BATCH];
 static int offset;
 
-static void spiceqxl_uinput_read_cb(int fd, int event, void *opaque)
+static struct {
+    int x;
+    int y;
+    int moved;
+    int buttons;
+    int wheel;
+    int seen_syn;   /* without SYN_REPORT, each read is a frame */
+} frame = { -1, -1 };
+
+static void post_frame(void)
 {
-    int n;
-    static int x = -1;
-    static int y = -1;
-    static int buttons_state = 0;
-    int button = -1;
-
-    n = read(uinput_fd, (char *)&inp_event + offset, sizeof(inp_event) - offset);
-    if (n == -1) {
-        if (errno != EAGAIN && errno != EINTR && errno != EWOULDBLOCK) {
-            fprintf(stderr, "spice: uinput read failed: %s\n", strerror(errno));
-        }
-        return;
+    if (frame.moved && frame.x >= 0 && frame.y >= 0) {
+        spiceqxl_tablet_position(frame.x, frame.y, frame.buttons);
     }
-    offset += n;
-    if (offset < sizeof(inp_event)) {
-        return;
+    frame.moved = FALSE;
+
+    spiceqxl_tablet_buttons(frame.buttons);
+
+    /* wheel clicks are the fourth and fifth buttons going down and up */
+    while (frame.wheel) {
+        int button = frame.wheel > 0 ? 1 << 3 : 1 << 4;
+
+        spiceqxl_tablet_buttons(frame.buttons | button);
+        spiceqxl_tablet_buttons(frame.buttons);
+        frame.wheel += frame.wheel > 0 ? -1 : 1;
     }
-    offset = 0;
-    switch (inp_event.type) {
+}
+
+static void handle_event(const struct input_event *ev)
+{
+    int button = 0;
+
+    switch (ev->type) {
     case EV_KEY:
         /*  XXX Here we hardcode vdagent-uinput.c mapping since we don't support ioctls.
          *  We could replace the ioctls with additional non uinput messages
          *  used in vdagentd fake uinput mode. */
-        switch (inp_event.code) {
+        switch (ev->code) {
         case BTN_LEFT:
             button = 1 << 0;
             break;
@@ -60,43 +79,66 @@ static void spiceqxl_uinput_read_cb(int fd, int event, void *opaque)
             button = 1 << 2;
             break;
         }
-        if (inp_event.value > 0) {
-            buttons_state |= button;
+        if (ev->value > 0) {
+            frame.buttons |= button;
         } else {
-            buttons_state &= ~button;
+            frame.buttons &= ~button;
         }
-        spiceqxl_tablet_buttons(buttons_state);
         break;
     case EV_REL:
-        button = 1;
-        if (inp_event.value == 1) {
-            button = 1 << 3;
-        } else {
-            button = 1 << 4;
-        }
-        buttons_state |= button;
-        spiceqxl_tablet_buttons(buttons_state);
-        buttons_state &= ~button;
-        spiceqxl_tablet_buttons(buttons_state);
+        frame.wheel += ev->value == 1 ? 1 : -1;
         break;
     case EV_ABS:
-        switch (inp_event.code) {
+        switch (ev->code) {
         case ABS_X:
-            x = inp_event.value;
+            frame.x = ev->value;
             break;
         case ABS_Y:
-            y = inp_event.value;
+            frame.y = ev->value;
             break;
         default:
-            fprintf(stderr, "%s: unknown axis %d, ignoring\n", __func__, inp_event.code);
+            fprintf(stderr, "%s: unknown axis %d, ignoring\n", __func__, ev->code);
             return;
-            break;
         }
-        spiceqxl_tablet_position(x, y, buttons_state);
+        frame.moved = TRUE;
+        break;
+    case EV_SYN:
+        if (ev->code == SYN_REPORT) {
+            frame.seen_syn = TRUE;
+            post_frame();
+        }
         break;
     }
 }
 
+static void spiceqxl_uinput_read_cb(int fd, int event, void *opaque)
+{
+    int n, i, count, wanted;
+
+    do {
+        wanted = sizeof(inp_events) - offset;
+        n = read(uinput_fd, (char *)inp_events + offset, wanted);
+        if (n == -1) {
+            if (errno != EAGAIN && errno != EINTR && errno != EWOULDBLOCK) {
+                fprintf(stderr, "spice: uinput read failed: %s\n", strerror(errno));
+            }
+            break;
+        }
+        offset += n;
+
+        count = offset / sizeof(struct input_event);
+        for (i = 0; i < count; i++) {
+            handle_event(&inp_events[i]);
+        }
+        offset -= count * sizeof(struct input_event);
+        memmove(inp_events, &inp_events[count], offset);
+    } while (n == wanted);
+
+    if (!frame.seen_syn) {
+        post_frame();
+    }
+}
+
 void spiceqxl_uinput_init(qxl_screen_t *qxl)
 {
     int ret;
@@ -4,6 +4,7 @@
 
 #include <errno.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -18,6 +19,25 @@ static const char *vdagent_virtio_filename;
 static int virtio_fd;
 static int virtio_client_fd = -1;
 static SpiceWatch *virtio_client_watch;
+static int virtio_client_mask;
+
+/* What vdagentd doesn't take right away is queued here, and the socket
+ * is watched for writing until the queue drains. Once the queue is full
+ * spice-server is told we took less than it gave, which makes it hold
+ * off until we wake it up again.
+ */
+#define MAX_QUEUED_CHUNKS 64
+#define MAX_QUEUED_BYTES (1024 * 1024)
+
+static struct {
+    uint8_t *data;
+    int len;
+} write_queue[MAX_QUEUED_CHUNKS];
+static int write_queue_head;
+static int write_queue_count;
+static int write_queue_bytes;
+static int write_queue_offset;   /* already sent of the head chunk */
+static int write_blocked;
 
 typedef struct XSpiceVdagentCharDeviceInstance {
     SpiceCharDeviceInstance base;
@@ -30,18 +50,135 @@ static XSpiceVdagentCharDeviceInstance vdagent_sin = {
     }
 };
 
-static int vmc_write(SpiceCharDeviceInstance *sin, const uint8_t *buf, int len)
+static void set_client_watch_mask(int mask)
+{
+    if (virtio_client_watch && mask != virtio_client_mask) {
+        vdagent_sin.qxl->core->watch_update_mask(virtio_client_watch, mask);
+        virtio_client_mask = mask;
+    }
+}
+
+static void drop_write_queue(void)
 {
+    while (write_queue_count) {
+        free(write_queue[write_queue_head].data);
+        write_queue_head = (write_queue_head + 1) % MAX_QUEUED_CHUNKS;
+        write_queue_count--;
+    }
+    write_queue_bytes = 0;
+    write_queue_offset = 0;
+}
+
+static int send_iov(struct iovec *iov, int n)
+{
+    struct msghdr msg;
     int written;
 
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    written = sendmsg(virtio_client_fd, &msg, MSG_NOSIGNAL);
+    if (written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    }
+    return written;
+}
+
+/* Returns -1 if vdagentd went away */
+static int flush_write_queue(void)
+{
+    struct iovec iov[MAX_QUEUED_CHUNKS];
+    int i, written;
+
+    if (!write_queue_count) {
+        return 0;
+    }
+
+    for (i = 0; i < write_queue_count; i++) {
+        int chunk = (write_queue_head + i) % MAX_QUEUED_CHUNKS;
+        int offset = i ? 0 : write_queue_offset;
+
+        iov[i].iov_base = write_queue[chunk].data + offset;
+        iov[i].iov_len = write_queue[chunk].len - offset;
+    }
+    written = send_iov(iov, write_queue_count);
+    if (written < 0) {
+        return -1;
+    }
+
+    write_queue_bytes -= written;
+    written += write_queue_offset;
+    while (write_queue_count && written >= write_queue[write_queue_head].len) {
+        written -= write_queue[write_queue_head].len;
+        free(write_queue[write_queue_head].data);
+        write_queue_head = (write_queue_head + 1) % MAX_QUEUED_CHUNKS;
+        write_queue_count--;
+    }
+    write_queue_offset = written;
+
+    return 0;
+}
+
+static int queue_write(const uint8_t *buf, int len)
+{
+    int chunk;
+    uint8_t *data;
+
+    len = min(len, MAX_QUEUED_BYTES - write_queue_bytes);
+    if (len <= 0 || write_queue_count == MAX_QUEUED_CHUNKS ||
+        !(data = malloc(len))) {
+        return 0;
+    }
+    memcpy(data, buf, len);
+
+    chunk = (write_queue_head + write_queue_count) % MAX_QUEUED_CHUNKS;
+    write_queue[chunk].data = data;
+    write_queue[chunk].len = len;
+    write_queue_count++;
+    write_queue_bytes += len;
+
+    return len;
+}
+
+static int vmc_write(SpiceCharDeviceInstance *sin, const uint8_t *buf, int len)
+{
+    int written = 0;
+
     if (virtio_client_fd == -1) {
         return 0;
     }
-    written = send(virtio_client_fd, buf, len, 0);
-    if (written != len) {
-        fprintf(stderr, "%s: ERROR: short write to vdagentd - TODO buffering\n", __func__);
+
+    if (flush_write_queue() < 0) {
+        goto error;
+    }
+
+    /* Nothing queued, so nothing to keep the order for */
+    if (!write_queue_count) {
+        struct iovec iov;
+
+        iov.iov_base = (void *)buf;
+        iov.iov_len = len;
+        if ((written = send_iov(&iov, 1)) < 0) {
+            goto error;
+        }
+    }
+
+    if (written < len) {
+        written += queue_write(buf + written, len - written);
+    }
+    if (written < len) {
+        write_blocked = TRUE;
+    }
+    if (write_queue_count) {
+        set_client_watch_mask(SPICE_WATCH_EVENT_READ | SPICE_WATCH_EVENT_WRITE);
     }
     return written;
+
+error:
+    /* the read side notices it's gone and cleans up */
+    fprintf(stderr, "%s: ERROR: write to vdagentd failed: %s\n", __func__, strerror(errno));
+    drop_write_queue();
+    return len;
 }
 
 static int vmc_read(SpiceCharDeviceInstance *sin, uint8_t *buf, int len)
@@ -61,18 +198,41 @@ static int vmc_read(SpiceCharDeviceInstance *sin, uint8_t *buf, int len)
         virtio_client_fd = -1;
         vdagent_sin.qxl->core->watch_remove(virtio_client_watch);
         virtio_client_watch = NULL;
+        drop_write_queue();
+        write_blocked = FALSE;
         spice_server_remove_interface(&vdagent_sin.base.base);
         spiceqxl_uinput_watch(vdagent_sin.qxl, FALSE);
     }
     return nbytes;
 }
 
-static void on_read_available(int fd, int event, void *opaque)
+static void on_io_available(int fd, int event, void *opaque)
 {
+    int wakeup = event & SPICE_WATCH_EVENT_READ;
+
     if (virtio_client_fd == -1) {
         return;
     }
-    spice_server_char_device_wakeup(&vdagent_sin.base);
+
+    if (event & SPICE_WATCH_EVENT_WRITE) {
+        if (flush_write_queue() < 0) {
+            drop_write_queue();
+        }
+        if (!write_queue_count) {
+            set_client_watch_mask(SPICE_WATCH_EVENT_READ);
+        }
+        /* spice-server is waiting for room to write the rest; let it
+         * refill before the queue runs dry to keep the socket busy */
+        if (write_blocked && write_queue_count < MAX_QUEUED_CHUNKS &&
+            write_queue_bytes <= MAX_QUEUED_BYTES / 2) {
+            write_blocked = FALSE;
+            wakeup = TRUE;
+        }
+    }
+
+    if (wakeup) {
+        spice_server_char_device_wakeup(&vdagent_sin.base);
+    }
 }
 
 #if SPICE_SERVER_VERSION >= 0x000c02
@@ -120,8 +280,9 @@ static void on_accept(int fd, int event, void *opaque)
                 strerror(errno));
         goto error;
     }
-    virtio_client_watch = qxl->core->watch_add(virtio_client_fd, SPICE_WATCH_EVENT_READ
-        /* TODO - SPICE_WATCH_EVENT_WRITE */, on_read_available, qxl);
+    virtio_client_watch = qxl->core->watch_add(virtio_client_fd, SPICE_WATCH_EVENT_READ,
+                                               on_io_available, qxl);
+    virtio_client_mask = SPICE_WATCH_EVENT_READ;
 
     spice_server_add_interface(qxl->spice_server, &vdagent_sin.base.base);
     spiceqxl_uinput_watch(qxl, TRUE);
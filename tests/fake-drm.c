@@ -0,0 +1,102 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "qxl.h"
+#include "fake-drm.h"
+
+/* Large enough for every surface the tests make */
+#define DEVICE_MEMORY	(4 * 1024 * 1024)
+
+fake_drm_t fake_drm;
+
+static uint32_t next_handle = 1;
+
+int
+fake_drm_open (void)
+{
+    char name[] = "/tmp/fake-qxl-XXXXXX";
+    int fd = mkstemp (name);
+
+    if (fd < 0)
+	return -1;
+
+    unlink (name);
+    if (ftruncate (fd, DEVICE_MEMORY) != 0)
+    {
+	close (fd);
+	return -1;
+    }
+
+    return fd;
+}
+
+int
+drmIoctl (int fd, unsigned long request, void *arg)
+{
+    switch (request)
+    {
+    case DRM_IOCTL_QXL_ALLOC_SURF:
+    {
+	struct drm_qxl_alloc_surf *param = arg;
+
+	fake_drm.n_alloc_surf++;
+	fake_drm.last_stride = param->stride;
+	if (fake_drm.alloc_surf_error)
+	{
+	    errno = fake_drm.alloc_surf_error;
+	    return -1;
+	}
+	param->handle = next_handle++;
+	fake_drm.n_live++;
+	return 0;
+    }
+
+    case DRM_IOCTL_QXL_MAP:
+    {
+	struct drm_qxl_map *map = arg;
+
+	fake_drm.n_map++;
+	if (fake_drm.map_error)
+	{
+	    errno = fake_drm.map_error;
+	    return -1;
+	}
+	map->offset = 0;
+	return 0;
+    }
+
+    case DRM_IOCTL_GEM_CLOSE:
+	fake_drm.n_gem_close++;
+	fake_drm.n_live--;
+	return 0;
+
+    default:
+	errno = EINVAL;
+	return -1;
+    }
+}
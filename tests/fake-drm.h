@@ -0,0 +1,47 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FAKE_DRM_H
+#define FAKE_DRM_H
+
+/* A fake of the qxl kernel driver behind drmIoctl(), for driving
+ * qxl_kms_bo.c without a device. Maps point into an unlinked file that
+ * stands in for the device memory.
+ */
+typedef struct
+{
+    /* errno for the ioctl to fail with, 0 to succeed */
+    int		alloc_surf_error;
+    int		map_error;
+
+    /* What was asked of it */
+    int		n_alloc_surf;
+    int		n_map;
+    int		n_gem_close;
+    int		n_live;		/* handles given out and not closed */
+    int		last_stride;
+} fake_drm_t;
+
+extern fake_drm_t fake_drm;
+
+/* Returns the file descriptor to use as the drm fd, -1 on failure */
+int fake_drm_open (void);
+
+#endif /* FAKE_DRM_H */
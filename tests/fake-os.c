@@ -0,0 +1,105 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+
+#include "fake-os.h"
+
+CARD32 fake_now;
+int fake_wakeups;
+int fake_stale_timers;
+
+static struct
+{
+    Bool		armed;
+    CARD32		due;
+    OsTimerCallback	func;
+    void *		arg;
+} x_timer;
+
+/* Only ever handed back to TimerSet and TimerFree */
+static char x_timer_storage;
+static Bool x_timer_allocated;
+
+CARD32
+GetTimeInMillis (void)
+{
+    return fake_now;
+}
+
+OsTimerPtr
+TimerSet (OsTimerPtr timer, int flags, CARD32 millis,
+	  OsTimerCallback func, void *arg)
+{
+    if (timer && !x_timer_allocated)
+	fake_stale_timers++;
+    x_timer_allocated = TRUE;
+
+    /* qxl_timer.c only uses relative timeouts */
+    x_timer.armed = millis != 0;
+    x_timer.due = fake_now + millis;
+    x_timer.func = func;
+    x_timer.arg = arg;
+
+    return (OsTimerPtr)&x_timer_storage;
+}
+
+void
+TimerFree (OsTimerPtr timer)
+{
+    if (!timer || !x_timer_allocated)
+	fake_stale_timers++;
+    x_timer.armed = FALSE;
+    x_timer_allocated = FALSE;
+}
+
+void
+fake_server_reset (void)
+{
+    x_timer.armed = FALSE;
+    x_timer_allocated = FALSE;
+}
+
+void
+fake_run_until (CARD32 time, CARD32 late)
+{
+    while (x_timer.armed && (int32_t)(x_timer.due + late - time) <= 0)
+    {
+	CARD32 delay;
+
+	fake_now = x_timer.due + late;
+	x_timer.armed = FALSE;
+	fake_wakeups++;
+
+	/* A non-zero return sets the timer again, as in the server */
+	delay = x_timer.func ((OsTimerPtr)&x_timer_storage, fake_now, x_timer.arg);
+	if (delay)
+	{
+	    x_timer.armed = TRUE;
+	    x_timer.due = fake_now + delay;
+	}
+    }
+
+    fake_now = time;
+}
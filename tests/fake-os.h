@@ -0,0 +1,42 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FAKE_OS_H
+#define FAKE_OS_H
+
+#include <os.h>
+
+/* A fake of the X server's clock and timer, for driving qxl_timer.c
+ * without a server. Time only moves when fake_run_until() is called.
+ */
+extern CARD32 fake_now;
+extern int fake_wakeups;
+extern int fake_stale_timers;	/* uses of a freed X timer */
+
+/* Advances the clock to time, running the X timer callback whenever it
+ * is due; late delivers each callback that many milliseconds after it
+ * was due, as a busy server would.
+ */
+void fake_run_until (CARD32 time, CARD32 late);
+
+/* Frees all X timers, as the server does when it resets */
+void fake_server_reset (void);
+
+#endif /* FAKE_OS_H */
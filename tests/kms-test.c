@@ -0,0 +1,241 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Drives the KMS surface allocator of qxl_kms_bo.c against a fake
+ * kernel driver, checking that an exhausted kernel sends pixmaps to
+ * system memory until a surface is freed, and that nothing leaks when
+ * an allocation fails half way.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "qxl.h"
+#include "qxl_surface.h"
+#include "fake-drm.h"
+
+static int n_failures;
+
+#define CHECK(cond, ...)						\
+    do {								\
+	if (!(cond))							\
+	{								\
+	    fprintf (stderr, "%s:%d: ", __FILE__, __LINE__);		\
+	    fprintf (stderr, __VA_ARGS__);				\
+	    fprintf (stderr, "\n");					\
+	    n_failures++;						\
+	}								\
+    } while (0)
+
+/* The server and pixman bits qxl_kms_bo.c calls */
+BoxRec RegionEmptyBox;
+RegDataRec RegionEmptyData;
+
+void
+ErrorF (const char *f, ...)
+{
+}
+
+void
+xf86DrvMsg (int scrnIndex, MessageType type, const char *format, ...)
+{
+}
+
+pixman_image_t *
+pixman_image_create_bits (pixman_format_code_t format, int width, int height,
+			  uint32_t *bits, int rowstride_bytes)
+{
+    /* Only ever handed back to pixman_image_unref */
+    return malloc (1);
+}
+
+pixman_bool_t
+pixman_image_unref (pixman_image_t *image)
+{
+    free (image);
+    return TRUE;
+}
+
+void
+qxl_get_formats (int bpp, SpiceSurfaceFmt *format, pixman_format_code_t *pformat)
+{
+    *format = SPICE_SURFACE_FMT_32_ARGB;
+    *pformat = PIXMAN_a8r8g8b8;
+}
+
+static ScrnInfoRec scrn;
+static qxl_screen_t qxl;
+
+static qxl_surface_t *
+create (int width, int height)
+{
+    return qxl.bo_funcs->create_surface (&qxl, width, height, 32);
+}
+
+static void
+destroy (qxl_surface_t *surface)
+{
+    qxl.bo_funcs->destroy_surface (surface);
+}
+
+static void
+reset (void)
+{
+    memset (&fake_drm, 0, sizeof fake_drm);
+    qxl.kms_surfaces_exhausted = FALSE;
+    qxl.enable_surfaces = TRUE;
+}
+
+static void
+test_create_destroy (void)
+{
+    qxl_surface_t *surface;
+
+    reset ();
+    surface = create (64, 48);
+    CHECK (surface != NULL, "surface not created");
+    if (!surface)
+	return;
+
+    CHECK (fake_drm.n_alloc_surf == 1, "%d ALLOC_SURF", fake_drm.n_alloc_surf);
+    CHECK (fake_drm.last_stride == -64 * 4,
+	   "stride %d, should be bottom up", fake_drm.last_stride);
+    CHECK (surface->id != 0, "no kernel handle");
+    CHECK (fake_drm.n_live == 1, "%d live handles", fake_drm.n_live);
+
+    destroy (surface);
+    CHECK (fake_drm.n_live == 0, "%d handles left", fake_drm.n_live);
+}
+
+static void
+test_exhausted (void)
+{
+    qxl_surface_t *keep, *surface;
+
+    reset ();
+    keep = create (64, 64);
+    CHECK (keep != NULL, "surface not created");
+
+    fake_drm.alloc_surf_error = ENOMEM;
+    surface = create (64, 64);
+    CHECK (surface == NULL, "created a surface without memory");
+    CHECK (qxl.kms_surfaces_exhausted, "ENOMEM didn't mark the kernel exhausted");
+
+    /* Until a surface is freed, the kernel isn't asked again */
+    fake_drm.alloc_surf_error = 0;
+    fake_drm.n_alloc_surf = 0;
+    surface = create (64, 64);
+    CHECK (surface == NULL, "created a surface while exhausted");
+    CHECK (fake_drm.n_alloc_surf == 0, "asked the kernel while exhausted");
+
+    if (keep)
+	destroy (keep);
+    CHECK (!qxl.kms_surfaces_exhausted, "freeing a surface didn't clear exhausted");
+
+    surface = create (64, 64);
+    CHECK (surface != NULL, "no surface after one was freed");
+    if (surface)
+	destroy (surface);
+
+    CHECK (fake_drm.n_live == 0, "%d handles left", fake_drm.n_live);
+}
+
+static void
+test_other_errors (void)
+{
+    qxl_surface_t *surface;
+
+    /* Only ENOMEM means the kernel is out of surfaces */
+    reset ();
+    fake_drm.alloc_surf_error = EINVAL;
+    surface = create (64, 64);
+    CHECK (surface == NULL, "created a surface the kernel refused");
+    CHECK (!qxl.kms_surfaces_exhausted, "EINVAL marked the kernel exhausted");
+
+    /* A surface that can't be mapped gives its handle back */
+    reset ();
+    fake_drm.map_error = EFAULT;
+    surface = create (64, 64);
+    CHECK (surface == NULL, "created a surface that couldn't be mapped");
+    CHECK (fake_drm.n_live == 0, "%d handles leaked", fake_drm.n_live);
+}
+
+static void
+test_primary (void)
+{
+    struct qxl_bo *bo;
+
+    /* The primary is not an offscreen surface; failing it says
+     * nothing about room for pixmaps
+     */
+    reset ();
+    fake_drm.alloc_surf_error = ENOMEM;
+    bo = qxl.bo_funcs->create_primary (&qxl, 640, 480, 640 * 4,
+				       SPICE_SURFACE_FMT_32_xRGB);
+    CHECK (bo == NULL, "created a primary without memory");
+    CHECK (!qxl.kms_surfaces_exhausted, "a failed primary marked the kernel exhausted");
+}
+
+static void
+test_disabled (void)
+{
+    reset ();
+    qxl.enable_surfaces = FALSE;
+    CHECK (create (64, 64) == NULL, "created a surface with surfaces disabled");
+    CHECK (fake_drm.n_alloc_surf == 0, "asked the kernel with surfaces disabled");
+}
+
+int
+main (int argc, char **argv)
+{
+    qxl.pScrn = &scrn;
+    qxl.kms_enabled = TRUE;
+    qxl.drm_fd = fake_drm_open ();
+    if (qxl.drm_fd < 0)
+    {
+	fprintf (stderr, "can't make the fake device memory\n");
+	return 1;
+    }
+    qxl_kms_setup_funcs (&qxl);
+
+    test_create_destroy ();
+    test_exhausted ();
+    test_other_errors ();
+    test_primary ();
+    test_disabled ();
+
+    close (qxl.drm_fd);
+
+    if (n_failures)
+    {
+	fprintf (stderr, "%d checks failed\n", n_failures);
+	return 1;
+    }
+
+    return 0;
+}
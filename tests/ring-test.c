@@ -0,0 +1,248 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Hammers the Xspice release ring from two threads: the spice side
+ * chaining and pushing released resources with qxl_chain_free_res() and
+ * qxl_push_free_res(), and the X side taking them off with qxl_ring_pop(),
+ * now and then blocking for memory with release_waiting set, as
+ * qxl_allocnf() does. Every resource must come back once, in order, with
+ * its contents intact. Build with -fsanitize=thread to have the memory
+ * ordering checked as well.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "qxl.h"
+#include "spiceqxl_release.h"
+
+#define N_RESOURCES	(1 << 20)
+#define FLUSH_EVERY	1000
+#define WAIT_EVERY	4096
+
+typedef struct resource_t resource_t;
+struct resource_t
+{
+    QXLReleaseInfo	info;
+    uint32_t		seq;
+    uint32_t		check;
+};
+
+static int n_failures;
+
+/* qxl_ring.c calls out to these; neither is reached by the release ring */
+void
+ErrorF (const char *f, ...)
+{
+    va_list args;
+
+    va_start (args, f);
+    vfprintf (stderr, f, args);
+    va_end (args);
+}
+
+void
+ioport_write (qxl_screen_t *qxl, uint32_t io_port, uint32_t val)
+{
+}
+
+void
+qxl_send_events (qxl_screen_t *qxl, int events)
+{
+}
+
+static void
+check_bunch (qxl_screen_t *qxl)
+{
+    if (qxl->free_bunch < QXL_FREE_BUNCH_MIN ||
+	qxl->free_bunch > QXL_FREE_BUNCH_MAX)
+    {
+	if (n_failures++ < 10)
+	    fprintf (stderr, "bunch %u out of bounds\n", qxl->free_bunch);
+    }
+}
+
+static resource_t *
+new_resource (uint32_t seq)
+{
+    resource_t *res = malloc (sizeof *res);
+
+    res->info.id = (uintptr_t)res;
+    res->info.next = 0;
+    res->seq = seq;
+    res->check = ~seq;
+
+    return res;
+}
+
+/* The spice server side: interface_release_resource() for every
+ * resource, with the odd interface_flush_resources() in between */
+static void *
+produce (void *arg)
+{
+    qxl_screen_t *qxl = arg;
+    uint32_t seq;
+
+    for (seq = 1; seq < N_RESOURCES; seq++)
+    {
+	qxl_chain_free_res (qxl, &new_resource (seq)->info);
+	check_bunch (qxl);
+
+	if (seq % FLUSH_EVERY == 0 && qxl->num_free_res)
+	    qxl_push_free_res (qxl, 1);
+    }
+
+    /* The ring may be full; keep flushing until the X side made room */
+    while (qxl->num_free_res)
+    {
+	qxl_push_free_res (qxl, 1);
+	if (qxl->num_free_res)
+	    sched_yield ();
+    }
+
+    return NULL;
+}
+
+/* Follows a chain popped off the ring, freeing it; returns the next
+ * sequence number expected */
+static uint32_t
+collect (uint64_t id, uint32_t expected)
+{
+    while (id)
+    {
+	resource_t *res = (resource_t *)(uintptr_t)id;
+
+	if (res->seq != expected || res->check != ~expected)
+	{
+	    if (n_failures++ < 10)
+		fprintf (stderr, "got resource %u (check %x), expected %u\n",
+			 res->seq, res->check, expected);
+	}
+	expected = res->seq + 1;
+	id = res->info.next;
+	free (res);
+    }
+
+    return expected;
+}
+
+int
+main (void)
+{
+    qxl_screen_t *qxl = calloc (1, sizeof *qxl);
+    QXLRam *ram = calloc (1, sizeof *ram);
+    QXLReleaseRing *release_ring = &ram->release_ring;
+    struct qxl_ring *ring;
+    pthread_t producer;
+    uint32_t expected = 0, next_wait = WAIT_EVERY;
+    int n_waits = 0;
+    uint64_t id;
+
+    /* dprint() traces every release to stdout; keep them out of the log */
+    if (!freopen ("/dev/null", "w", stdout))
+	return 1;
+
+    qxl->rom = calloc (1, sizeof *qxl->rom);
+    qxl->rom->ram_header_offset = 0;
+    qxl->ram = ram;
+    qxl_init_free_res (qxl);
+
+    SPICE_RING_INIT (release_ring);
+    ring = qxl_ring_create ((struct qxl_ring_header *)release_ring,
+			    sizeof (uint64_t), QXL_RELEASE_RING_SIZE, 0, NULL);
+
+    /* A single release is held back while X isn't short, and handed over
+     * right away once it is waiting for memory */
+    qxl_chain_free_res (qxl, &new_resource (0)->info);
+    if (qxl_ring_pop (ring, &id))
+    {
+	fprintf (stderr, "lone release pushed while X isn't waiting\n");
+	n_failures++;
+	expected = collect (id, expected);
+    }
+    __atomic_store_n (&qxl->release_waiting, 1, __ATOMIC_RELAXED);
+    qxl_push_free_res (qxl, 0);
+    __atomic_store_n (&qxl->release_waiting, 0, __ATOMIC_RELAXED);
+    if (!qxl_ring_pop (ring, &id))
+    {
+	fprintf (stderr, "release held back while X is waiting\n");
+	return 1;
+    }
+    expected = collect (id, expected);
+
+    if (pthread_create (&producer, NULL, produce, qxl) != 0)
+    {
+	fprintf (stderr, "can't start the producer\n");
+	return 1;
+    }
+
+    /* The X side, as in qxl_garbage_collect() and qxl_allocnf() */
+    while (expected < N_RESOURCES)
+    {
+	if (expected >= next_wait)
+	{
+	    /* Out of memory: ask for releases, and block until some come */
+	    __atomic_store_n (&qxl->release_waiting, 1, __ATOMIC_RELAXED);
+	    while (!qxl_ring_pop (ring, &id))
+		sched_yield ();
+	    __atomic_store_n (&qxl->release_waiting, 0, __ATOMIC_RELAXED);
+	    next_wait = expected + WAIT_EVERY;
+	    n_waits++;
+	}
+	else if (!qxl_ring_pop (ring, &id))
+	{
+	    sched_yield ();
+	    continue;
+	}
+
+	expected = collect (id, expected);
+    }
+
+    pthread_join (producer, NULL);
+
+    if (qxl_ring_pop (ring, &id))
+    {
+	fprintf (stderr, "ring not empty at the end\n");
+	n_failures++;
+    }
+
+    if (n_waits == 0)
+    {
+	fprintf (stderr, "X never waited for releases\n");
+	n_failures++;
+    }
+
+    free (ring);
+    free (qxl->rom);
+    free (ram);
+    free (qxl);
+
+    if (n_failures)
+	fprintf (stderr, "%d failures\n", n_failures);
+
+    return n_failures ? 1 : 0;
+}
@@ -0,0 +1,207 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Compares the timer wheel of qxl_timer.c with a sorted list like the
+ * X server's own timers, for thousands of timers that keep re-arming
+ * themselves and restarting each other, as spice-server's do.
+ *
+ * Usage: timer-bench [simulated seconds]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "fake-os.h"
+#include "qxl_timer.h"
+
+#define MAX_PERIOD	200
+
+/* The workload, shared by both implementations */
+static uint32_t
+next_period (void)
+{
+    return 1 + rand () % MAX_PERIOD;
+}
+
+static double
+now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* The timer wheel */
+
+static qxl_timer_t **wheel_timers;
+static int n_timers;
+static long n_fired;
+
+static void
+wheel_fired (void *opaque)
+{
+    qxl_timer_t **timer = opaque;
+
+    n_fired++;
+    qxl_timer_start (*timer, next_period ());
+    qxl_timer_start (wheel_timers[rand () % n_timers], next_period ());
+}
+
+static double
+bench_wheel (int n, CARD32 duration)
+{
+    double start;
+    int i;
+
+    srand (n);
+    n_timers = n;
+    n_fired = 0;
+    wheel_timers = calloc (n, sizeof *wheel_timers);
+
+    for (i = 0; i < n; ++i)
+	wheel_timers[i] = qxl_timer_add (wheel_fired, &wheel_timers[i]);
+
+    start = now_ns ();
+
+    for (i = 0; i < n; ++i)
+	qxl_timer_start (wheel_timers[i], next_period ());
+
+    fake_run_until (fake_now + duration, 0);
+
+    start = (now_ns () - start) / n_fired;
+
+    for (i = 0; i < n; ++i)
+	qxl_timer_remove (wheel_timers[i]);
+    free (wheel_timers);
+
+    return start;
+}
+
+/* A sorted list, searched from the head on every start */
+
+typedef struct list_timer_t list_timer_t;
+struct list_timer_t
+{
+    list_timer_t *	next;
+    list_timer_t *	prev;
+    CARD32		expires;
+    Bool		pending;
+};
+
+static list_timer_t list_head;
+static list_timer_t *list_timers;
+
+static void
+list_cancel (list_timer_t *timer)
+{
+    if (!timer->pending)
+	return;
+
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->pending = FALSE;
+}
+
+static void
+list_start (list_timer_t *timer, CARD32 now, uint32_t ms)
+{
+    list_timer_t *after = &list_head;
+
+    list_cancel (timer);
+    timer->expires = now + ms;
+
+    while (after->next != &list_head &&
+	   (int32_t)(after->next->expires - timer->expires) <= 0)
+    {
+	after = after->next;
+    }
+
+    timer->prev = after;
+    timer->next = after->next;
+    after->next->prev = timer;
+    after->next = timer;
+    timer->pending = TRUE;
+}
+
+static double
+bench_list (int n, CARD32 duration)
+{
+    CARD32 now = fake_now, end = fake_now + duration;
+    double start;
+    int i;
+
+    srand (n);
+    n_fired = 0;
+    list_head.next = list_head.prev = &list_head;
+    list_timers = calloc (n, sizeof *list_timers);
+
+    start = now_ns ();
+
+    for (i = 0; i < n; ++i)
+	list_start (&list_timers[i], now, next_period ());
+
+    while (list_head.next != &list_head &&
+	   (int32_t)(list_head.next->expires - end) <= 0)
+    {
+	list_timer_t *timer = list_head.next;
+
+	now = timer->expires;
+	list_cancel (timer);
+
+	n_fired++;
+	list_start (timer, now, next_period ());
+	list_start (&list_timers[rand () % n], now, next_period ());
+    }
+
+    start = (now_ns () - start) / n_fired;
+
+    free (list_timers);
+
+    return start;
+}
+
+int
+main (int argc, char **argv)
+{
+    static const int counts[] = { 100, 1000, 5000 };
+    CARD32 duration = 2000;
+    unsigned i;
+
+    if (argc > 1)
+	duration = atoi (argv[1]) * 1000;
+
+    printf ("%8s %16s %16s\n", "timers", "wheel ns/fire", "list ns/fire");
+
+    for (i = 0; i < sizeof (counts) / sizeof (counts[0]); ++i)
+    {
+	double wheel = bench_wheel (counts[i], duration);
+	double list = bench_list (counts[i], duration);
+
+	printf ("%8d %16.1f %16.1f\n", counts[i], wheel, list);
+    }
+
+    return 0;
+}
@@ -0,0 +1,468 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * on the rights to use, copy, modify, merge, publish, distribute, sub
+ * license, and/or sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Drives the timer wheel of qxl_timer.c with a fake clock and checks
+ * that every timer fires exactly when it is due, across all levels.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fake-os.h"
+#include "qxl_timer.h"
+
+/* The longest timeout the wheel keeps, see qxl_timer.c */
+#define MAX_TIMEOUT	((1U << 26) - 1)
+
+typedef struct probe_t probe_t;
+struct probe_t
+{
+    qxl_timer_t *	timer;
+    CARD32		expected;
+    CARD32		slack;		/* ms it may be late by on its own */
+    CARD32		fired_at;
+    int			n_fired;
+
+    /* What the callback does */
+    int			n_rearm;
+    uint32_t		rearm_ms;
+    probe_t *		cancel;
+    probe_t *		remove;
+    Bool		remove_self;
+};
+
+static int n_failures;
+static CARD32 last_fired;
+
+#define CHECK(cond, ...)						\
+    do {								\
+	if (!(cond))							\
+	{								\
+	    fprintf (stderr, "%s:%d: ", __FILE__, __LINE__);		\
+	    fprintf (stderr, __VA_ARGS__);				\
+	    fprintf (stderr, "\n");					\
+	    n_failures++;						\
+	}								\
+    } while (0)
+
+static void
+probe_fired (void *opaque)
+{
+    probe_t *probe = opaque;
+
+    probe->fired_at = fake_now;
+    probe->n_fired++;
+
+    CHECK ((int32_t)(fake_now - last_fired) >= 0,
+	   "timer fired at %u, before one that fired at %u",
+	   fake_now, last_fired);
+    last_fired = fake_now;
+
+    if (probe->cancel)
+	qxl_timer_cancel (probe->cancel->timer);
+
+    if (probe->remove)
+    {
+	qxl_timer_remove (probe->remove->timer);
+	probe->remove->timer = NULL;
+	probe->remove = NULL;
+    }
+
+    if (probe->n_rearm > 0)
+    {
+	probe->n_rearm--;
+	probe->expected = fake_now + probe->rearm_ms;
+	probe->slack = 0;
+	qxl_timer_start (probe->timer, probe->rearm_ms);
+    }
+
+    if (probe->remove_self)
+    {
+	qxl_timer_remove (probe->timer);
+	probe->timer = NULL;
+    }
+}
+
+static void
+probe_init (probe_t *probe)
+{
+    probe->timer = qxl_timer_add (probe_fired, probe);
+    if (!probe->timer)
+    {
+	fprintf (stderr, "out of memory\n");
+	exit (1);
+    }
+}
+
+static void
+probe_start (probe_t *probe, uint32_t ms)
+{
+    probe->expected = fake_now + min (ms, MAX_TIMEOUT);
+    /* X timers can't be set to 0 ms, so those may wait for the next one */
+    probe->slack = ms == 0;
+    probe->n_fired = 0;
+    qxl_timer_start (probe->timer, ms);
+}
+
+/* Runs until every started probe should have fired */
+static void
+run_past (CARD32 when, CARD32 late)
+{
+    fake_run_until (when + late + 2, late);
+}
+
+static void
+check_fired_once (probe_t *probe, uint32_t ms, CARD32 late)
+{
+    CHECK (probe->n_fired == 1,
+	   "%u ms timer fired %d times", ms, probe->n_fired);
+    if (probe->n_fired == 1)
+    {
+	CHECK ((int32_t)(probe->fired_at - probe->expected) >= 0 &&
+	       probe->fired_at - probe->expected <= late + probe->slack,
+	       "%u ms timer due at %u fired at %u",
+	       ms, probe->expected, probe->fired_at);
+    }
+}
+
+/* Delays around the edges of every level, from a few starting points */
+static const uint32_t delays[] = {
+    0, 1, 2, 127, 255, 256, 257, 511, 1000,
+    (1 << 14) - 257, (1 << 14) - 1, 1 << 14, (1 << 14) + 1, (1 << 14) + 255,
+    3 * (1 << 14) + 7, 63 * (1 << 14) + 300,
+    (1 << 20) - 1, 1 << 20, (1 << 20) + 1, 5000000,
+    MAX_TIMEOUT - 256, MAX_TIMEOUT - 1, MAX_TIMEOUT,
+};
+
+#define N_DELAYS (sizeof (delays) / sizeof (delays[0]))
+
+static const CARD32 bases[] = {
+    0, 1, 200, 255, 256, (1 << 14) - 3, (1 << 20) + 77,
+    /* the millisecond clock wraps around */
+    0xffffff00, 0xfffffff0 - (1 << 20),
+};
+
+#define N_BASES (sizeof (bases) / sizeof (bases[0]))
+
+static void
+test_levels_one_by_one (void)
+{
+    probe_t probe = { 0 };
+    unsigned i, j;
+
+    probe_init (&probe);
+
+    for (i = 0; i < N_BASES; ++i)
+    {
+	for (j = 0; j < N_DELAYS; ++j)
+	{
+	    fake_run_until (bases[i], 0);
+	    last_fired = fake_now;
+
+	    probe_start (&probe, delays[j]);
+	    run_past (probe.expected, 0);
+	    check_fired_once (&probe, delays[j], 0);
+	}
+    }
+
+    qxl_timer_remove (probe.timer);
+}
+
+static void
+test_levels_together (CARD32 late)
+{
+    probe_t probes[N_DELAYS] = { { 0 } };
+    unsigned i, j;
+
+    for (j = 0; j < N_DELAYS; ++j)
+	probe_init (&probes[j]);
+
+    for (i = 0; i < N_BASES; ++i)
+    {
+	CARD32 last_due = 0;
+
+	fake_run_until (bases[i], 0);
+	last_fired = fake_now;
+
+	/* Every level holds timers at once, so cascades interleave */
+	for (j = 0; j < N_DELAYS; ++j)
+	{
+	    probe_start (&probes[j], delays[j]);
+	    if ((int32_t)(probes[j].expected - last_due) > 0 || j == 0)
+		last_due = probes[j].expected;
+	}
+
+	run_past (last_due, late);
+
+	for (j = 0; j < N_DELAYS; ++j)
+	    check_fired_once (&probes[j], delays[j], late);
+    }
+
+    for (j = 0; j < N_DELAYS; ++j)
+	qxl_timer_remove (probes[j].timer);
+}
+
+static void
+test_clamp (void)
+{
+    static const uint32_t too_long[] = {
+	MAX_TIMEOUT + 1, 1U << 27, 0x7fffffff, 0xffffffff,
+    };
+    probe_t probe = { 0 };
+    unsigned i;
+
+    probe_init (&probe);
+
+    for (i = 0; i < sizeof (too_long) / sizeof (too_long[0]); ++i)
+    {
+	fake_run_until (fake_now + 12345, 0);
+	last_fired = fake_now;
+
+	probe_start (&probe, too_long[i]);
+	CHECK (probe.expected == fake_now + MAX_TIMEOUT,
+	       "test expects %u ms to be clamped", too_long[i]);
+
+	/* Nothing before the clamped time */
+	fake_run_until (probe.expected - 1, 0);
+	CHECK (probe.n_fired == 0, "%u ms timer fired early", too_long[i]);
+
+	run_past (probe.expected, 0);
+	check_fired_once (&probe, too_long[i], 0);
+    }
+
+    qxl_timer_remove (probe.timer);
+}
+
+static void
+test_rearm (void)
+{
+    static const uint32_t periods[] = { 0, 1, 7, 255, 256, 1 << 14, 100000 };
+    probe_t probe = { 0 };
+    unsigned i;
+
+    probe_init (&probe);
+
+    for (i = 0; i < sizeof (periods) / sizeof (periods[0]); ++i)
+    {
+	CARD32 start;
+	int n = 20;
+
+	fake_run_until (fake_now + 3, 0);
+	last_fired = start = fake_now;
+
+	probe.n_rearm = n - 1;
+	probe.rearm_ms = periods[i];
+	probe_start (&probe, periods[i]);
+
+	run_past (start + n * max (periods[i], 1), 0);
+
+	CHECK (probe.n_fired == n, "%u ms ticker fired %d times of %d",
+	       periods[i], probe.n_fired, n);
+	/* Restarted at 0 ms from its callback, a ticker runs again in
+	 * the same or the next millisecond */
+	CHECK (periods[i] ? probe.fired_at == start + n * periods[i]
+	       : probe.fired_at - start <= (CARD32)n,
+	       "%u ms ticker last fired at %u, started at %u",
+	       periods[i], probe.fired_at, start);
+    }
+
+    qxl_timer_remove (probe.timer);
+}
+
+static void
+test_cancel (void)
+{
+    probe_t a = { 0 }, b = { 0 }, c = { 0 }, d = { 0 };
+
+    probe_init (&a);
+    probe_init (&b);
+    probe_init (&c);
+    probe_init (&d);
+
+    /* Cancelled before it is due */
+    fake_run_until (fake_now + 5, 0);
+    last_fired = fake_now;
+    probe_start (&a, 1000);
+    probe_start (&b, 20000);
+    fake_run_until (fake_now + 500, 0);
+    qxl_timer_cancel (a.timer);
+    qxl_timer_cancel (b.timer);
+    run_past (fake_now + 20000, 0);
+    CHECK (a.n_fired == 0 && b.n_fired == 0,
+	   "cancelled timers fired %d and %d times", a.n_fired, b.n_fired);
+
+    /* Cancelling what is due in the same millisecond, from a callback */
+    last_fired = fake_now;
+    a.cancel = &b;
+    probe_start (&a, 300);
+    probe_start (&b, 300);
+    run_past (a.expected, 0);
+    CHECK (a.n_fired == 1 && b.n_fired == 0,
+	   "cancel from a callback: fired %d and %d times",
+	   a.n_fired, b.n_fired);
+    a.cancel = NULL;
+
+    /* Removing one that is due in the same millisecond, and itself */
+    last_fired = fake_now;
+    c.remove = &d;
+    c.remove_self = TRUE;
+    probe_start (&c, 40000);
+    probe_start (&d, 40000);
+    run_past (c.expected, 0);
+    CHECK (c.n_fired == 1 && d.n_fired == 0,
+	   "remove from a callback: fired %d and %d times",
+	   c.n_fired, d.n_fired);
+    CHECK (c.timer == NULL && d.timer == NULL, "timers not removed");
+
+    /* Restarting cancels the earlier start */
+    last_fired = fake_now;
+    probe_start (&a, 100);
+    probe_start (&a, 50000);
+    run_past (a.expected, 0);
+    check_fired_once (&a, 50000, 0);
+
+    qxl_timer_remove (a.timer);
+    qxl_timer_remove (b.timer);
+}
+
+/* Random starts, restarts and cancels against the expected times */
+static void
+test_random (CARD32 late)
+{
+#define N_RANDOM 2000
+    static probe_t probes[N_RANDOM];
+    Bool pending[N_RANDOM];
+    CARD32 end;
+    int i, round;
+
+    srand (1);
+
+    for (i = 0; i < N_RANDOM; ++i)
+    {
+	probe_init (&probes[i]);
+	pending[i] = FALSE;
+    }
+
+    for (round = 0; round < 200; ++round)
+    {
+	for (i = 0; i < N_RANDOM; ++i)
+	{
+	    if (pending[i] && probes[i].n_fired)
+	    {
+		check_fired_once (&probes[i], 0, late);
+		pending[i] = FALSE;
+	    }
+
+	    switch (rand () % 8)
+	    {
+	    case 0:
+		qxl_timer_cancel (probes[i].timer);
+		pending[i] = FALSE;
+		break;
+	    case 1:
+	    case 2:
+		probe_start (&probes[i], rand () % (1 << 21));
+		pending[i] = TRUE;
+		break;
+	    case 3:
+		probe_start (&probes[i], rand () % 512);
+		pending[i] = TRUE;
+		break;
+	    }
+	}
+
+	last_fired = fake_now;
+	fake_run_until (fake_now + rand () % 20000, late);
+    }
+
+    end = fake_now + (1 << 21) + late + 1;
+    fake_run_until (end, late);
+
+    for (i = 0; i < N_RANDOM; ++i)
+    {
+	if (pending[i])
+	    check_fired_once (&probes[i], 0, late);
+	qxl_timer_remove (probes[i].timer);
+    }
+#undef N_RANDOM
+}
+
+/* The screen closing and the server resetting, with a timer of
+ * spice-server still pending across it
+ */
+static void
+test_server_reset (void)
+{
+    probe_t pending = { 0 }, probe = { 0 };
+
+    probe_init (&pending);
+    probe_init (&probe);
+
+    fake_run_until (fake_now + 1000, 0);
+    last_fired = fake_now;
+    probe_start (&pending, 500);
+
+    qxl_timer_fini ();
+    fake_server_reset ();
+
+    fake_run_until (fake_now + 100, 0);
+    CHECK (pending.n_fired == 0, "timer fired while the server was down");
+
+    /* The next screen's first timer sets the wheel going again */
+    probe_start (&probe, 10);
+    run_past (probe.expected, 0);
+    check_fired_once (&probe, 10, 0);
+
+    run_past (pending.expected, 0);
+    check_fired_once (&pending, 500, 0);
+
+    CHECK (fake_stale_timers == 0, "a freed X timer was used");
+
+    qxl_timer_remove (pending.timer);
+    qxl_timer_remove (probe.timer);
+}
+
+int
+main (int argc, char **argv)
+{
+    fake_now = 1000;
+
+    test_levels_one_by_one ();
+    test_levels_together (0);
+    test_levels_together (37);
+    test_clamp ();
+    test_rearm ();
+    test_cancel ();
+    test_random (0);
+    test_random (3);
+    test_server_reset ();
+
+    if (n_failures)
+    {
+	fprintf (stderr, "%d checks failed\n", n_failures);
+	return 1;
+    }
+
+    return 0;
+}